@@ -0,0 +1,192 @@
+#undef _FORTIFY_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include <State.h>
+#include <reader.h>
+
+// Headless simulation of a die, writing a trace sview can load.
+//
+// The configuration is the mview one (map, layers, pins, nmos|cmos,
+// then optionally "threads <n>" on its own line).
+// The script has one command per line:
+//   # comment
+//   frame-nets <n>     frame size for a schematic with n nets, the
+//                      extra ones (mschem power nets) are written as 0
+//   force <net> 0|1    force a net and propagate
+//   release <net>      stop forcing a net and propagate
+//   step [<n>]         write the current state n times (default 1)
+//   osc <n>            run n cycles of the osc* nets, writing the
+//                      state after each half-cycle
+//   save <file>        save the simulation state
+//   load <file>        restore a saved simulation state
+//   threads <n>        propagate with the levelized engine on n
+//                      threads, 0 for the in-place one
+//
+// Each frame is one bit per net, net 0 in bit 0 of the first byte,
+// a set bit meaning the net is at 1.
+
+static State *state;
+static FILE *trace;
+static std::vector<unsigned char> frame;
+static long frames;
+
+static void write_frame()
+{
+  memset(frame.data(), 0, frame.size());
+  for(int i=0; i != state->info.nnets; i++)
+    if(state->power[i] == State::S_1)
+      frame[i >> 3] |= 1 << (i & 7);
+  if(fwrite(frame.data(), frame.size(), 1, trace) != 1) {
+    perror("Writing trace");
+    exit(1);
+  }
+  frames++;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc != 4) {
+    fprintf(stderr, "Usage:\n%s config.txt script.txt trace.bin\n", argv[0]);
+    exit(1);
+  }
+
+  reader rd(argv[1]);
+  const char *map_file = rd.gw();
+  const char *layers_file = rd.gw();
+  const char *pins_file = rd.gw();
+  bool cmos;
+  const char *mode = rd.gw();
+  if(!strcmp(mode, "nmos"))
+    cmos = false;
+  else if(!strcmp(mode, "cmos"))
+    cmos = true;
+  else {
+    fprintf(stderr, "Mode [%s] unknown\n", mode);
+    exit(1);
+  }
+  rd.nl();
+  int threads = 0;
+  while(!rd.eof()) {
+    if(rd.peek() == '\n') {
+      rd.nl();
+      continue;
+    }
+    std::string keyw = rd.gw();
+    if(keyw == "threads") {
+      threads = rd.gi();
+      rd.nl();
+    } else {
+      fprintf(stderr, "Unknown keyword %s\n", keyw.c_str());
+      exit(1);
+    }
+  }
+
+  state = new State(layers_file, map_file, pins_file, cmos);
+  state->threads = threads;
+  state->reset_to_zero();
+
+  std::vector<int> osc;
+  for(int i=0; i != state->info.nnets; i++)
+    if(state->oscillator[i])
+      osc.push_back(i);
+
+  trace = fopen(argv[3], "wb");
+  if(!trace) {
+    char msg[4096];
+    sprintf(msg, "Open %s", argv[3]);
+    perror(msg);
+    exit(1);
+  }
+
+  int frame_nets = state->info.nnets;
+  frame.resize((frame_nets+7)/8);
+
+  reader sc(argv[2]);
+  while(!sc.eof()) {
+    if(sc.peek() == '\n') {
+      sc.nl();
+      continue;
+    }
+
+    std::string keyw = sc.gw();
+
+    if(keyw[0] == '#') {
+      sc.nl();
+      continue;
+    }
+
+    if(keyw == "frame-nets") {
+      frame_nets = sc.gi();
+      sc.nl();
+      if(frame_nets < state->info.nnets) {
+	fprintf(stderr, "frame-nets %d is less than the %d nets of the die\n", frame_nets, state->info.nnets);
+	exit(1);
+      }
+      frame.resize((frame_nets+7)/8);
+
+    } else if(keyw == "force") {
+      int net = state->ninfo.find(sc.gw());
+      std::string level = sc.gw();
+      sc.nl();
+      if(level != "0" && level != "1") {
+	fprintf(stderr, "Level [%s] unknown\n", level.c_str());
+	exit(1);
+      }
+      state->force(net, level == "1" ? State::S_1 : State::S_0);
+
+    } else if(keyw == "release") {
+      int net = state->ninfo.find(sc.gw());
+      sc.nl();
+      state->force(net, State::S_FLOAT);
+
+    } else if(keyw == "step") {
+      int count = sc.eol() ? 1 : sc.gi();
+      sc.nl();
+      for(int i=0; i != count; i++)
+	write_frame();
+
+    } else if(keyw == "osc") {
+      int count = sc.gi();
+      sc.nl();
+      for(int i=0; i != count; i++)
+	for(int p = State::S_0; p <= State::S_1; p++) {
+	  for(int net : osc) {
+	    state->forced_power[net] = p;
+	    state->power[net] = p;
+	  }
+	  state->apply_changed(osc);
+	  write_frame();
+	}
+
+    } else if(keyw == "threads") {
+      state->threads = sc.gi();
+      sc.nl();
+
+    } else if(keyw == "save") {
+      std::string fname = sc.gwnl();
+      sc.nl();
+      if(!state->save(fname.c_str()))
+	exit(1);
+
+    } else if(keyw == "load") {
+      std::string fname = sc.gwnl();
+      sc.nl();
+      if(!state->load(fname.c_str()))
+	exit(1);
+
+    } else {
+      fprintf(stderr, "Unknown keyword %s\n", keyw.c_str());
+      exit(1);
+    }
+  }
+
+  fclose(trace);
+  fprintf(stderr, "%ld frames of %d bytes written\n", frames, int(frame.size()));
+  return 0;
+}
@@ -0,0 +1,455 @@
+#undef _FORTIFY_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include <State.h>
+#include <BitState.h>
+#include <images.h>
+#include <fill.h>
+
+// Pipeline benchmark on synthetic dies.
+//
+// Generates a die of rows x cols cells in workdir, extracts it with
+// generate-circuit, then times the libdie stages on the result.
+// Patterns:
+//   chain          one chain of inverters per row, with an in<r> input
+//   ring           one ring oscillator per row
+//   chain-mg       chain in metal gate nmos
+//   adder          one ripple carry chain per row, each cell an and-or-
+//                  invert gate ~(g | p & cin) with ing/inp inputs
+//   register-file  one bit line per row, one word per column, each word
+//                  a latch and an access transistor on word line inw<c>
+//
+// The bit-parallel settle is checked against State on a few lanes,
+// every net compared.  A ring of an odd number of cells oscillates,
+// its lanes do not converge and are not checked.  The settle reports
+// how many lanes failed to converge and which ones.
+//
+// With a thread count, the reset and the events are also run on the
+// levelized engine at 1, 2, 4... threads up to it, for the scaling.
+//
+// The generate-circuit stages, and the mschem ones when its path is
+// given, come from the programs' own profile output.  sview's
+// generate_image() is not covered, it draws through the Qt widgets and
+// has no headless entry point.
+//
+// Results go to stdout, one JSON object per stage and per line, so
+// that runs can be compared with any line-oriented tool.
+
+static std::string die_name;
+
+static double now()
+{
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void report(const char *stage, double seconds, long count)
+{
+  printf("{\"die\":\"%s\",\"stage\":\"%s\",\"seconds\":%.6f,\"count\":%ld}\n", die_name.c_str(), stage, seconds, count);
+  fflush(stdout);
+}
+
+// Same with the lanes that did not converge, as a count and a mask
+static void report_lanes(const char *stage, double seconds, BitState::lanes failed)
+{
+  printf("{\"die\":\"%s\",\"stage\":\"%s\",\"seconds\":%.6f,\"count\":%d,\"failed\":%d,\"failed_lanes\":\"%016llx\"}\n", die_name.c_str(), stage, seconds, int(BitState::LANES), __builtin_popcountll(failed), (unsigned long long)failed);
+  fflush(stdout);
+}
+
+struct layer {
+  pbm *img;
+
+  layer(std::string fname, int sx, int sy) {
+    bool created;
+    unlink(fname.c_str());
+    img = new pbm(fname.c_str(), sx, sy, created);
+  }
+
+  ~layer() {
+    delete img;
+  }
+
+  void rect(int x0, int y0, int x1, int y1) {
+    for(int y=y0; y<=y1; y++)
+      for(int x=x0; x<=x1; x++)
+	img->s(x, y, true);
+  }
+};
+
+// Cells are 20x46, between a vcc bus on the left edge and a gnd bus on
+// the right one.  Every third poly cell uses a buried contact load.
+// Register file words take three cells, the two inverters of the latch
+// and the access transistor.  The latches keep the vcc gate load, that
+// the simulator lets a bit line overpower.
+static void generate_die(std::string dir, std::string pattern, int rows, int cols, int &sx, int &sy)
+{
+  enum { CW = 20, CH = 46 };
+
+  bool ring = pattern == "ring";
+  bool mg = pattern == "chain-mg";
+  bool adder = pattern == "adder";
+  bool rf = pattern == "register-file";
+  if(!ring && !mg && !adder && !rf && pattern != "chain") {
+    fprintf(stderr, "Pattern [%s] unknown\n", pattern.c_str());
+    exit(1);
+  }
+
+  int cells = rf ? 3*cols : cols;
+  sx = 8 + cells*CW + 12;
+  sy = rows*CH + 2;
+
+  layer active(dir + "/active.pbm", sx, sy);
+  layer metal(dir + "/metal.pbm", sx, sy);
+  layer vias(dir + "/vias.pbm", sx, sy);
+  layer poly(dir + (mg ? "/gates.pbm" : "/poly.pbm"), sx, sy);
+  layer buried(dir + "/buried.pbm", mg ? 1 : sx, mg ? 1 : sy);
+
+  FILE *pins = fopen((dir + "/pins.txt").c_str(), "w");
+  metal.rect(0, 0, 1, sy-1);
+  metal.rect(sx-2, 0, sx-1, sy-1);
+  fprintf(pins, "m 0 0 vcc\nm %d 0 gnd\n", sx-1);
+
+  // Word lines run over the whole height, between the rows' latches
+  if(rf)
+    for(int c=0; c != cols; c++) {
+      int ox = 8 + (3*c+2)*CW;
+      poly.rect(ox+9, 0, ox+11, sy-1);
+      fprintf(pins, "p %d 0 inw%d\n", ox+10, c);
+    }
+
+  for(int r=0; r != rows; r++) {
+    int oy = 1 + r*CH;
+    metal.rect(0, oy+4, sx-5, oy+7);
+    metal.rect(4, oy+39, sx-1, oy+43);
+    if(rf) {
+      metal.rect(4, oy+31, sx-5, oy+33);
+      fprintf(pins, "m 4 %d inb%d\n", oy+32, r);
+    }
+    for(int c=0; c != cells; c++) {
+      int ox = 8 + c*CW;
+      int slot = rf ? c % 3 : -1;
+      if(slot == 2) {
+	// Access transistor between the latch output and the bit line,
+	// wide enough to overpower the latch pulldown
+	active.rect(ox+2, oy+21, ox+4, oy+26);
+	active.rect(ox+2, oy+24, ox+15, oy+33);
+	vias.rect(ox+2, oy+22, ox+4, oy+23);
+	vias.rect(ox+13, oy+31, ox+15, oy+32);
+	continue;
+      }
+      if(!mg) {
+	active.rect(ox+8, oy+5, ox+13, oy+42);
+	vias.rect(ox+9, oy+5, ox+12, oy+6);
+	if(!rf && c % 3 == 1) {
+	  poly.rect(ox+6, oy+10, ox+13, oy+17);
+	  poly.rect(ox+6, oy+10, ox+7, oy+20);
+	  poly.rect(ox+6, oy+19, ox+9, oy+20);
+	  buried.rect(ox+7, oy+18, ox+10, oy+21);
+	} else {
+	  poly.rect(ox+2, oy+10, ox+13, oy+17);
+	  poly.rect(ox+2, oy+5, ox+5, oy+17);
+	  vias.rect(ox+2, oy+5, ox+5, oy+6);
+	}
+	poly.rect(ox+2, oy+27, ox+13, oy+29);
+	poly.rect(ox+2, oy+21, ox+4, oy+29);
+	if(c && slot != 0)
+	  vias.rect(ox+2, oy+22, ox+4, oy+23);
+	if(adder) {
+	  // p in series with the carry, g in parallel on a second strip
+	  poly.rect(ox+6, oy+33, ox+13, oy+35);
+	  active.rect(ox+13, oy+24, ox+17, oy+26);
+	  active.rect(ox+15, oy+24, ox+17, oy+42);
+	  poly.rect(ox+15, oy+29, ox+18, oy+31);
+	  vias.rect(ox+15, oy+40, ox+17, oy+41);
+	  fprintf(pins, "p %d %d inp%d_%d\n", ox+6, oy+34, r, c);
+	  fprintf(pins, "p %d %d ing%d_%d\n", ox+18, oy+30, r, c);
+	}
+	if(slot == 0) {
+	  // Latch feedback from the second inverter, over the top
+	  poly.rect(ox-3, oy+0, ox-1, oy+29);
+	  poly.rect(ox-3, oy+27, ox+2, oy+29);
+	  poly.rect(ox-3, oy+0, ox+CW+17, oy+2);
+	} else if(slot == 1) {
+	  poly.rect(ox+15, oy+0, ox+17, oy+23);
+	  vias.rect(ox+15, oy+22, ox+17, oy+23);
+	}
+      } else {
+	active.rect(ox+8, oy+5, ox+13, oy+9);
+	active.rect(ox+8, oy+18, ox+13, oy+26);
+	active.rect(ox+8, oy+30, ox+13, oy+42);
+	poly.rect(ox+8, oy+10, ox+13, oy+17);
+	poly.rect(ox+8, oy+27, ox+13, oy+29);
+	vias.rect(ox+9, oy+5, ox+12, oy+6);
+	metal.rect(ox+8, oy+7, ox+13, oy+17);
+	metal.rect(ox+2, oy+27, ox+13, oy+29);
+	metal.rect(ox+2, oy+21, ox+4, oy+29);
+      }
+      vias.rect(ox+9, oy+40, ox+12, oy+41);
+      vias.rect(ox+9, oy+22, ox+12, oy+23);
+      metal.rect(ox+9, oy+21, ox+CW+4, oy+23);
+    }
+
+    if(rf)
+      continue;
+    int lx = 8 + cols*CW;
+    if(ring) {
+      // Loop the last output back to the first gate over the row
+      poly.rect(lx+2, oy+0, lx+4, oy+23);
+      vias.rect(lx+2, oy+22, lx+4, oy+23);
+      poly.rect(8-4, oy+0, lx+4, oy+2);
+      poly.rect(8-4, oy+0, 8-2, oy+29);
+      poly.rect(8-4, oy+27, 8+2, oy+29);
+    } else
+      fprintf(pins, "%c %d %d in%d\n", mg ? 'm' : 'p', 8+2, oy+25, r);
+    fprintf(pins, "a %d %d out%d\n", lx-CW+10, oy+20, r);
+  }
+  fclose(pins);
+
+  FILE *cf = fopen((dir + "/gc.txt").c_str(), "w");
+  fprintf(cf, "%s/cmap.bin %s/circuit.txt %d %d\n", dir.c_str(), dir.c_str(), sx, sy);
+  fprintf(cf, "%s\n", mg ? "nmos-metal-gate" : "nmos-poly-single-metal");
+  fprintf(cf, "active %s/active\nmetal %s/metal\nvias %s/vias\n", dir.c_str(), dir.c_str(), dir.c_str());
+  if(mg)
+    fprintf(cf, "gates %s/gates\n", dir.c_str());
+  else
+    fprintf(cf, "poly %s/poly\nburied %s/buried\n", dir.c_str(), dir.c_str());
+  fprintf(cf, "profile %s/gc.json\n", dir.c_str());
+  fclose(cf);
+
+  cf = fopen((dir + "/mview.txt").c_str(), "w");
+  fprintf(cf, "%s/cmap.bin %s/circuit.txt %s/pins.txt nmos\n", dir.c_str(), dir.c_str(), dir.c_str());
+  fclose(cf);
+}
+
+// Report the stages of a profile written by time_info::report(), one
+// per line after the header
+static void report_profile(std::string program, std::string fname)
+{
+  FILE *fd = fopen(fname.c_str(), "r");
+  if(!fd) {
+    perror(fname.c_str());
+    exit(1);
+  }
+  char line[4096];
+  double total = 0;
+  while(fgets(line, sizeof(line), fd)) {
+    const char *p = strstr(line, "\"wall_seconds\":");
+    if(!p)
+      continue;
+    double seconds = strtod(p + 15, NULL);
+    const char *st = strstr(line, "{\"stage\":\"");
+    if(!st) {
+      total = seconds;
+      continue;
+    }
+    st += 10;
+    const char *items = strstr(line, "\"items\":");
+    std::string stage = program + "/" + std::string(st, strchr(st, '"') - st);
+    report(stage.c_str(), seconds, items ? strtol(items + 8, NULL, 10) : 0);
+  }
+  fclose(fd);
+  report(program.c_str(), total, 0);
+}
+
+static void run(std::string cmd)
+{
+  if(system(cmd.c_str())) {
+    fprintf(stderr, "%s failed\n", cmd.c_str());
+    exit(1);
+  }
+}
+
+// The previous tiles and labels go, a rerun would be incremental
+static void run_generate_circuit(std::string gc, std::string dir)
+{
+  unlink((dir + "/cmap.bin.tiles").c_str());
+  unlink((dir + "/cmap.bin.labels").c_str());
+  unlink((dir + "/gc.json").c_str());
+  run(gc + " " + dir + "/gc.txt > " + dir + "/gc.log 2>&1");
+  report_profile("generate-circuit", dir + "/gc.json");
+}
+
+// Draw the tile pyramid of the extracted die with mschem, without pads
+static void run_mschem(std::string mschem, std::string dir)
+{
+  FILE *fd = fopen((dir + "/mschem.lua").c_str(), "w");
+  fprintf(fd, "setup(\"%s/cmap.bin\", \"%s/circuit.txt\", \"%s/pins.txt\", \"%s/pads.txt\", 1, false)\n", dir.c_str(), dir.c_str(), dir.c_str(), dir.c_str());
+  fprintf(fd, "tiles(\"%s/tiles\")\n", dir.c_str());
+  fprintf(fd, "profile(\"%s/mschem.json\")\n", dir.c_str());
+  fclose(fd);
+  fd = fopen((dir + "/pads.txt").c_str(), "w");
+  fprintf(fd, "# no pads\n");
+  fclose(fd);
+  mkdir((dir + "/tiles").c_str(), 0777);
+  unlink((dir + "/mschem.json").c_str());
+  run(mschem + " " + dir + "/mschem.lua > " + dir + "/mschem.log 2>&1");
+  report_profile("mschem", dir + "/mschem.json");
+}
+
+static bool fill_test(const pbm *img, const std::vector<int> *seen, int x, int y)
+{
+  return !img->p(x, y) || (*seen)[y*img->sx + x];
+}
+
+static void fill_set(std::vector<int> *seen, int sx, int x, int y)
+{
+  (*seen)[y*sx + x] = 1;
+}
+
+static int fill_color(int x, int y)
+{
+  return 0;
+}
+
+// Label the connected zones of a layer with libdie's fill()
+static void bench_fill(std::string fname)
+{
+  pbm img(fname.c_str());
+  std::vector<int> seen(img.sx*img.sy);
+  double t = now();
+  long zones = 0;
+  for(int y=0; y != img.sy; y++)
+    for(int x=0; x != img.sx; x++)
+      if(!fill_test(&img, &seen, x, y)) {
+	fill(x, y, img.sx, img.sy, 0,
+	     boost::bind(fill_set, &seen, img.sx, _1, _2),
+	     boost::bind(fill_color, _1, _2),
+	     boost::bind(fill_test, &img, &seen, _1, _2));
+	zones++;
+      }
+  report("fill", now() - t, zones);
+}
+
+static void bench_events(State *state, const std::vector<int> &inputs, int events, const char *stage)
+{
+  if(inputs.empty())
+    events = 0;
+  srand(1);
+  double t = now();
+  for(int i=0; i != events; i++) {
+    int net = inputs[rand() % inputs.size()];
+    state->force(net, state->power[net] == State::S_1 ? State::S_0 : State::S_1);
+  }
+  report(stage, now() - t, events);
+}
+
+// Replay lanes of the bit-parallel settle on the State, forcing the
+// inputs as in the lane, and exit on the first net that differs
+static void bench_bitstate_check(State *state, const BitState &bits, const std::vector<int> &inputs, BitState::lanes failed)
+{
+  double t = now();
+  int checked = 0;
+  for(int lane=0; lane < BitState::LANES; lane += 9) {
+    BitState::lanes bit = BitState::lanes(1) << lane;
+    if(failed & bit)
+      continue;
+    for(int net : inputs)
+      state->forced_power[net] = state->power[net] = bits.forced_high[net] & bit ? State::S_1 : State::S_0;
+    state->reset_to_zero();
+    for(int i=0; i != state->info.nnets; i++)
+      if(state->power[i] != bits.get(i, lane)) {
+	fprintf(stderr, "Lane %d differs from State on net %s\n", lane, state->ninfo.net_name(i).c_str());
+	exit(1);
+      }
+    checked++;
+  }
+  report("bitstate-check", now() - t, checked);
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 6 || argc > 9) {
+    fprintf(stderr, "Usage:\n%s generate-circuit workdir chain|ring|chain-mg|adder|register-file rows cols [events [threads [mschem]]]\n", argv[0]);
+    exit(1);
+  }
+
+  std::string gc = argv[1];
+  std::string dir = argv[2];
+  std::string pattern = argv[3];
+  int rows = atoi(argv[4]);
+  int cols = atoi(argv[5]);
+  int events = argc > 6 ? atoi(argv[6]) : 1000;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  std::string mschem = argc > 8 ? argv[8] : "";
+
+  char buf[256];
+  sprintf(buf, "%s-%dx%d", pattern.c_str(), rows, cols);
+  die_name = buf;
+  mkdir(dir.c_str(), 0777);
+
+  int sx, sy;
+  double t = now();
+  generate_die(dir, pattern, rows, cols, sx, sy);
+  report("generate-die", now() - t, long(sx)*sy);
+
+  run_generate_circuit(gc, dir);
+  if(!mschem.empty())
+    run_mschem(mschem, dir);
+  bench_fill(dir + "/active.pbm");
+
+  t = now();
+  State *state = new State((dir + "/circuit.txt").c_str(), (dir + "/cmap.bin").c_str(), (dir + "/pins.txt").c_str(), false);
+  report("state-load", now() - t, state->info.nnets);
+
+  std::vector<int> inputs;
+  for(int i=0; i != state->info.nnets; i++)
+    if(state->ninfo.names[i].substr(0, 2) == "in")
+      inputs.push_back(i);
+
+  // Inputs are sources from the start, so that the bit lines can write
+  for(int net : inputs)
+    state->force(net, State::S_0);
+  t = now();
+  state->reset_to_zero();
+  report("reset-to-zero", now() - t, state->info.nnets);
+
+  bench_events(state, inputs, events, "events");
+
+  // The levelized engine at 1, 2, 4... threads up to the given count,
+  // each run from the start of the in-place one and checked to end on
+  // the same levels.  The reset is one big wave, the events small ones.
+  std::vector<int> levels = state->power;
+  std::vector<int> counts;
+  for(int n = 1; n < threads; n *= 2)
+    counts.push_back(n);
+  if(threads)
+    counts.push_back(threads);
+  for(int n : counts) {
+    state->threads = n;
+    for(int net : inputs)
+      state->forced_power[net] = state->power[net] = State::S_0;
+    t = now();
+    state->reset_to_zero();
+    sprintf(buf, "reset-to-zero-levelized-%d", n);
+    report(buf, now() - t, state->info.nnets);
+    sprintf(buf, "events-levelized-%d", n);
+    bench_events(state, inputs, events, buf);
+    if(state->power != levels) {
+      fprintf(stderr, "Levelized engine at %d threads differs from the in-place one\n", n);
+      exit(1);
+    }
+  }
+  state->threads = 0;
+
+  BitState bits(*state);
+  srand(1);
+  for(int net : inputs)
+    bits.force(net, (BitState::lanes(rand()) << 32) ^ rand(), State::S_1);
+  t = now();
+  BitState::lanes failed = bits.reset_to_zero();
+  report_lanes("bitstate-settle", now() - t, failed);
+  bench_bitstate_check(state, bits, inputs, failed);
+
+  delete state;
+  return 0;
+}
@@ -13,6 +13,7 @@
 #include <map>
 
 #include <reader.h>
+#include <timing.h>
 
 #include "nanosvg.h"
 #include "nanosvgrast.h"
@@ -88,11 +89,13 @@ test_f test_functions[] = {
 
 int main(int argc, char **argv)
 {
-  if(argc != 2) {
-    fprintf(stderr, "Usage:\n%s config.txt\n", argv[0]);
+  if(argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage:\n%s config.txt [profile.json]\n", argv[0]);
     exit(1);
   }
 
+  time_info tinfo;
+  tinfo.stage("loading svg");
   reader rd(argv[1]);
   const char *fname = rd.gw();
   sx = rd.gi();
@@ -157,6 +160,8 @@ int main(int argc, char **argv)
     const char *layer_name = rd.gwnl();
     rd.nl();
 
+    tinfo.stage(layer_name);
+    tinfo.count(long(sx)*sy);
     printf("%s\n", layer_name);
     fflush(stdout);
     for(std::map<std::string, int>::const_iterator j = layer_offsets.begin(); j != layer_offsets.end(); j++)
@@ -220,5 +225,9 @@ int main(int argc, char **argv)
   delete[] out;
   nsvgDeleteRasterizer(rast);
 
+  tinfo.finish();
+  if(argc == 3 && !tinfo.report(argv[2], "generate-bitmask-images"))
+    exit(1);
+
   return 0;
 }
@@ -4,6 +4,8 @@
 #include <reader.h>
 #include <images.h>
 #include <timing.h>
+#include <circuit_db.h>
+#include <circuit_map_tiled.h>
 
 #include <string.h>
 #include <stdlib.h>
@@ -12,21 +14,44 @@
   #include <windows.h>
 #else
   #include <sys/mman.h>
+  #include <unistd.h>
 #endif
 #include <math.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include <set>
 #include <map>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
+#include <algorithm>
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 
 using namespace std;
 
+// Write the map in the tiled format of circuit_map_tiled.h.  The map
+// is then built in a raw scratch file next to it, encoded at the end
+// and removed.
+bool tiled_map = false;
+
+pbm *active = NULL;
+pbm *gates = NULL;
+pbm *buried = NULL;
+pbm *metal = NULL;
+pbm *poly = NULL;
+pbm *vias = NULL;
+pbm *caps = NULL;
+
 struct circuit_map {
   int *data;
   int nl, sx, sy;
+  string work_name;
 
   int p(int l, int x, int y) const {
     return data[nl*(x+y*sx)+l];
@@ -36,37 +61,17 @@ struct circuit_map {
     data[nl*(x+y*sx)+l] = v;
   }
 
+  // Rows of the map a sweep may keep in memory, 0 for all of them
+  int window_rows() const;
+
+  // Drop the rows from the process, the file keeps them
+  void release_rows(int y0, int y1) const;
+
+  // Without create, the map of the previous run is rewritten in place
   circuit_map(const char *fname, int nl, int sx, int sy, bool create);
   ~circuit_map();
 };
 
-circuit_map::circuit_map(const char *fname, int _nl, int _sx, int _sy, bool create)
-{
-  nl = _nl;
-  sx = _sx;
-  sy = _sy;
-  unsigned char *map_adr;
-  if(create) {
-    create_file_rw(fname, map_adr, nl*4*(int64_t)sx*sy);
-    memset(map_adr, 0xff, (int64_t)sx*sy*4*nl);
-
-  } else {
-    int64_t size;
-    map_file_ro(fname, map_adr, size, false);
-  }
-
-  data = (int *)map_adr;
-}
-
-circuit_map::~circuit_map()
-{
-  #ifdef _WIN32
-    UnmapViewOfFile(data);
-  #else
-    munmap(data, long(nl)*sx*sy*4);
-  #endif
-}
-
 enum {
   ACTIVE,
   POLY,
@@ -84,7 +89,7 @@ struct circuit_info {
   int surface;
   int x0, y0, x1, y1;
   int net, netp, metal;
-  std::set<int> neighbors;
+  std::vector<int> neighbors; // sorted
 };
 
 struct via_info {
@@ -97,22 +102,23 @@ struct via_info {
   }
 };
 
+// Poly sides of capacitors are listed as id + cap_poly_offset
 struct net_info {
-  set<int> circuits;
+  std::vector<int> circuits;
 };
 
+int cap_poly_offset = 1000000;
+
 struct trans_info {
   int circ, t1, t2, gate, x, y;
   double strength;
 };
 
+// Via edges grouped by source circuit, the ones of circuit i being
+// at index[i] to index[i+1]-1, in via order
 struct via_map {
-  std::map<int, std::vector<int> > metal_to_ap, ap_to_metal;
-};
-
-struct fill_coord {
-  int x, y;
-  fill_coord(int _x, int _y) { x = _x; y = _y; }
+  std::vector<int> metal_index, metal_to_ap;
+  std::vector<int> ap_index, ap_to_metal;
 };
 
 struct metal_link_info {
@@ -120,64 +126,209 @@ struct metal_link_info {
   int circuit_id;
 };
 
-void fill_1(std::vector<fill_coord> &fc, int x, int y, int sx, int sy, int color, boost::function<void(int, int)> set_pixel, boost::function<int(int, int)> read_color, boost::function<bool(int, int)> test_pixel)
-{
-  if(test_pixel(x, y))
-    return;
-  set_pixel(x, y);
-  int x0 = x-1;
-  while(x0 >= 0 && !test_pixel(x0, y) && read_color(x0, y) == color) {
-    set_pixel(x0, y);
-    x0--;
-  }
-  x0++;
-  int x1 = x+1;
-  while(x1 < sx && !test_pixel(x1, y) && read_color(x1, y) == color) {
-    set_pixel(x1, y);
-    x1++;
-  }
-  x1--;
-  for(int xx=x0; xx<=x1; xx++) {
-    if(y > 0   && !test_pixel(xx, y-1) && read_color(xx, y-1) == color)
-      fc.push_back(fill_coord(xx, y-1));
-    if(y < sy-1 && !test_pixel(xx, y+1) && read_color(xx, y+1) == color)
-      fc.push_back(fill_coord(xx, y+1));
+// Worker threads for the sweeps over the map, 0 for one per core
+int threads = 0;
+
+// Megabytes for the per-thread row chunks, and for the rows of the map
+// the sweeps keep in memory, the rest staying in the map file.  0 for
+// 256 rows per chunk and the whole map in memory.
+int chunk_memory = 0;
+
+// Region of interest.  When set, the layers are cropped to it and the
+// crop is extracted as a die of its own.  x/y is the top-left corner
+// of the crop in the die, yb the offset to add to bottom-up
+// coordinates, and cut[] tells which of the left, top, right and
+// bottom sides cut through the die.  Those sides get PAD empty pixels
+// so that the windows around the pixels stay inside the crop.
+// Messages give die coordinates.
+struct roi_info {
+  enum { PAD = 8 };
+  bool active;
+  int x, y, yb, sx, sy;
+  bool cut[4];
+
+  bool border(const circuit_info &ci) const {
+    return active && ((cut[0] && ci.x0 <= PAD) || (cut[1] && ci.y0 <= PAD) || (cut[2] && ci.x1 >= sx-1-PAD) || (cut[3] && ci.y1 >= sy-1-PAD));
   }
+};
+
+roi_info roi;
+
+static int row_bands(int rows)
+{
+  if(rows < 1)
+    return 0;
+  int nb = threads ? threads : std::thread::hardware_concurrency();
+  if(nb < 1)
+    nb = 1;
+  return nb > rows ? rows : nb;
 }
 
-void fill(int x, int y, int sx, int sy, int color, boost::function<void(int, int)> set_pixel, boost::function<int(int, int)> read_color, boost::function<bool(int, int)> test_pixel)
+// Rows per chunk for a die of width sx, at least 16
+static int chunk_rows(int sx, int sy)
 {
-  std::vector<fill_coord> fc;
-  fc.push_back(fill_coord(x, y));
-  while(!fc.empty()) {
-    int xx = fc.front().x;
-    int yy = fc.front().y;
-    fc.erase(fc.begin());
-    fill_1(fc, xx, yy, sx, sy, color, set_pixel, read_color, test_pixel);
+  if(!chunk_memory)
+    return 256;
+  int64_t rows = (int64_t(chunk_memory) << 20) / (int64_t(max(1, row_bands(sy))) * sx);
+  return rows < 16 ? 16 : rows > sy ? sy : rows;
+}
+
+// Split rows in row_bands() bands and call f(y0, y1, band) on each
+// band in parallel.  Band 0 runs in the calling thread, so only it
+// should tick the progress.
+static void parallel_rows(int rows, const std::function<void(int, int, int)> &f)
+{
+  int nb = row_bands(rows);
+  std::vector<std::thread> workers;
+  for(int b=1; b < nb; b++)
+    workers.push_back(std::thread(f, int(int64_t(rows)*b/nb), int(int64_t(rows)*(b+1)/nb), b));
+  if(nb)
+    f(0, rows/nb, 0);
+  for(auto &t : workers)
+    t.join();
+}
+
+// Call f(i, thread) on every item of [0, count) from one thread per
+// band, handing out the items in batches as the threads get free.
+// Thread 0 is the calling one.
+static void parallel_items(int count, int batch, const std::function<void(int, int)> &f)
+{
+  int nt = row_bands((count + batch - 1) / batch);
+  std::atomic<int> next(0);
+  auto work = [&](int thread) {
+    for(;;) {
+      int i = next.fetch_add(batch);
+      if(i >= count)
+	break;
+      int e = std::min(i + batch, count);
+      for(; i != e; i++)
+	f(i, thread);
+    }
+  };
+  std::vector<std::thread> workers;
+  for(int t=1; t < nt; t++)
+    workers.push_back(std::thread(work, t));
+  if(nt)
+    work(0);
+  for(auto &t : workers)
+    t.join();
+}
+
+circuit_map::circuit_map(const char *fname, int _nl, int _sx, int _sy, bool create)
+{
+  nl = _nl;
+  sx = _sx;
+  sy = _sy;
+  unsigned char *map_adr;
+  if(create) {
+    if(tiled_map) {
+      work_name = string(fname) + ".tmp";
+      fname = work_name.c_str();
+    }
+    create_file_rw(fname, map_adr, nl*4*(int64_t)sx*sy);
+    data = (int *)map_adr;
+    int rows = window_rows();
+    if(!rows)
+      rows = sy;
+    for(int y=0; y < sy; y += rows) {
+      int y1 = min(y + rows, sy);
+      memset(data + int64_t(nl)*sx*y, 0xff, int64_t(y1 - y)*sx*4*nl);
+      release_rows(y, y1);
+    }
+
+  } else {
+    int64_t size;
+    map_file_rw(fname, map_adr, size);
   }
+
+  data = (int *)map_adr;
 }
 
-void color_active_poly_set(int x, int y, int *pmap, bool *is_buried, bool *is_caps)
+circuit_map::~circuit_map()
 {
-  int v = pmap[x+y*11];
-  if(v & 2)
-    *is_buried = true;
-  if(v & 4)
-    *is_caps = true;
-  pmap[x+y*11] = v | 8;
+  #ifdef _WIN32
+    UnmapViewOfFile(data);
+  #else
+    munmap(data, long(nl)*sx*sy*4);
+  #endif
+  if(!work_name.empty())
+    remove(work_name.c_str());
 }
 
-int color_active_poly_read(int x, int y, int *pmap)
+// The windows of all the bands fit in chunk-memory, as the colorer
+// chunks do
+int circuit_map::window_rows() const
 {
-  return pmap[x+y*11] & 1;
+  if(!chunk_memory)
+    return 0;
+  int64_t rows = (int64_t(chunk_memory) << 20) / (int64_t(max(1, row_bands(sy))) * nl * 4 * sx);
+  return rows < 16 ? 16 : rows > sy ? sy : rows;
 }
 
-bool color_active_poly_test(int x, int y, int *pmap)
+void circuit_map::release_rows(int y0, int y1) const
 {
-  return pmap[x+y*11] & 8;
+  if(y1 > sy)
+    y1 = sy;
+  #ifndef _WIN32
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = uintptr_t(data + int64_t(nl)*sx*y0);
+    uintptr_t end = uintptr_t(data + int64_t(nl)*sx*y1);
+    start = (start + page - 1) & ~(page - 1);
+    end = end & ~(page - 1);
+    if(start < end)
+      madvise((void *)start, end - start, MADV_DONTNEED);
+  #endif
 }
 
-int color_active_poly(int x, int y, const pbm *active, const pbm *poly, const pbm *buried, const pbm *caps)
+// Encode the map in the tiled format a band of tiles at a time,
+// releasing each band once written
+void save_tiled_map(const char *fname, circuit_map &cmap)
+{
+  circuit_map_tiled_writer w(fname, cmap.nl, cmap.sx, cmap.sy);
+  for(int y=0; y < cmap.sy; y += CIRCUIT_MAP_TILE) {
+    w.add_band(cmap.data + int64_t(cmap.nl)*cmap.sx*y);
+    cmap.release_rows(y, min(y + int(CIRCUIT_MAP_TILE), cmap.sy));
+  }
+  w.close();
+}
+
+// A sweep over rows y0 onwards drops the rows of the map and of the
+// layers it is done with from memory a window at a time, and what is
+// left of the window when it ends, since a band sweep is often shorter
+// than a window
+struct map_sweep {
+  const circuit_map &cmap;
+  int y0, y1, rows;
+
+  map_sweep(const circuit_map &_cmap, int y) : cmap(_cmap) {
+    y0 = y1 = y;
+    rows = cmap.window_rows();
+  }
+
+  ~map_sweep() {
+    if(rows)
+      release();
+  }
+
+  // The rows before y are not needed anymore
+  void done(int y) {
+    y1 = y;
+    if(rows && y1 - y0 >= rows)
+      release();
+  }
+
+  void release() {
+    if(y0 >= y1)
+      return;
+    cmap.release_rows(y0, y1);
+    for(const pbm *img : { active, gates, buried, metal, poly, vias, caps })
+      if(img)
+	img->release_rows(y0, y1);
+    y0 = y1;
+  }
+};
+
+int color_active_poly_window(int x, int y, const pbm *active, const pbm *poly, const pbm *buried, const pbm *caps)
 {
   bool ca = active->p(x, y);
   bool cp = poly->p(x, y);
@@ -196,9 +347,29 @@ int color_active_poly(int x, int y, const pbm *active, const pbm *poly, const pb
 	  int y1 = y-5+yy;
 	  pmap[yy*11+xx] = active->p(x1, y1) && poly->p(x1, y1) ? buried->p(x1, y1) ? 3 : caps && caps->p(x1, y1) ? 5 : 1 : 0;
 	}
+      // Flood the overlap from the center, 8 marks the visited cells
       bool is_buried = false;
       bool is_caps = false;
-      fill(5, 5, 11, 11, 1, boost::bind(color_active_poly_set, _1, _2, pmap, &is_buried, & is_caps), boost::bind(color_active_poly_read, _1, _2, pmap), boost::bind(color_active_poly_test, _1, _2, pmap));
+      int stack[11*11];
+      int sp = 0;
+      stack[sp++] = 5*11+5;
+      pmap[5*11+5] |= 8;
+      while(sp) {
+	int pos = stack[--sp];
+	int v = pmap[pos];
+	if(v & 2)
+	  is_buried = true;
+	if(v & 4)
+	  is_caps = true;
+	int xx = pos % 11;
+	int yy = pos / 11;
+	int next[4] = { xx > 0 ? pos-1 : -1, xx < 10 ? pos+1 : -1, yy > 0 ? pos-11 : -1, yy < 10 ? pos+11 : -1 };
+	for(int i=0; i != 4; i++)
+	  if(next[i] != -1 && (pmap[next[i]] & 9) == 1) {
+	    pmap[next[i]] |= 8;
+	    stack[sp++] = next[i];
+	  }
+      }
       return is_caps ? CAPACITOR : is_buried ? BURIED : TRANSISTOR;
     }
   }
@@ -206,94 +377,603 @@ int color_active_poly(int x, int y, const pbm *active, const pbm *poly, const pb
   return ca ? ACTIVE : cp ? POLY : -1;
 }
 
-int color_active_gates(int x, int y, const pbm *active, const pbm *gates, const pbm *caps)
+// Connected components labeling in two passes over scanline runs.
+// The first pass gives each run of a line the label of the first run
+// of the same type it touches in the previous line, merging the
+// labels of the other ones, and accumulates bounding box and surface
+// per label.  The labels are then tied to circuit ids, numbered in
+// the order of their first pixel as with a flood fill, and write_map
+// puts the ids in the map once the circuits are cleaned up.
+//
+// Each band of rows is labeled on its own, then the labels are put
+// end to end in band order, which keeps them in order of first pixel,
+// and the runs on each side of the seams between bands are merged.
+
+struct cc_label {
+  int parent, type, surface;
+  int x0, y0, x1, y1;
+};
+
+struct cc_run {
+  int x0, x1, type, label;
+};
+
+// The colorers give the runs of a line, with consecutive runs of the
+// same type merged
+static void cc_add_run(std::vector<cc_run> &runs, int x0, int x1, int type)
 {
-  bool ca = active->p(x, y);
-  bool cg = gates->p(x, y);
-  bool cc = caps && caps->p(x, y);
-  assert(!(cg && cc));
-  if(cc)
-    return CAPACITOR;
-  if(ca)
-    return ACTIVE;
-  if(cg)
-    return TRANSISTOR;
-  return -1;
+  if(!runs.empty() && runs.back().type == type && runs.back().x1 == x0-1) {
+    runs.back().x1 = x1;
+    return;
+  }
+  cc_run r;
+  r.x0 = x0;
+  r.x1 = x1;
+  r.type = type;
+  r.label = -1;
+  runs.push_back(r);
 }
 
-int color_metal(int x, int y, const pbm *metal)
+// Active/poly colorer.  The rows are classified by chunks as the
+// labeling reaches them, into cls (type+1, 0 for nothing).  An overlap
+// can only be buried or a capacitor if it is connected within 5 pixels
+// to a buried or caps overlap pixel, so the window check is only done
+// on the overlaps reached by a flood from those pixels over the chunk
+// and 5 rows around it, and on the ones too near the die edges for the
+// window to fit.  All the other overlaps are transistors.  Each band
+// of the labeling gets its own copy, so the memory used depends on the
+// die width and the chunk size, not on the die height.
+
+struct active_poly_colorer {
+  enum { CHECK = 0x80 };
+  const pbm *active, *poly, *buried, *caps;
+  int rows, y0, y1, h0;
+  std::vector<unsigned char> cls;
+
+  active_poly_colorer(const pbm *_active, const pbm *_poly, const pbm *_buried, const pbm *_caps, int _rows) {
+    active = _active;
+    poly = _poly;
+    buried = _buried;
+    caps = _caps;
+    rows = _rows;
+    y0 = y1 = h0 = 0;
+  }
+
+  void classify(int y);
+  void operator()(int y, std::vector<cc_run> &runs);
+};
+
+void active_poly_colorer::classify(int y)
 {
-  return metal->p(x, y) ? METAL : -1;
+  int sx = active->sx, sy = active->sy;
+  int nw = active->nw();
+  y0 = y;
+  y1 = min(sy, y + rows);
+  h0 = max(0, y0 - 5);
+  int h1 = min(sy, y1 + 5);
+  int64_t size = int64_t(h1 - h0)*sx;
+  cls.resize(size);
+
+  std::vector<int64_t> stack;
+  std::vector<uint64_t> ra(nw), rp(nw), rb(nw), rc(nw);
+  for(int yy = h0; yy != h1; yy++) {
+    active->row(yy, ra.data());
+    poly->row(yy, rp.data());
+    buried->row(yy, rb.data());
+    if(caps) {
+      caps->row(yy, rc.data());
+      pbm::row_or(rb.data(), rc.data(), nw);
+    }
+    unsigned char *c = cls.data() + int64_t(yy - h0)*sx;
+    for(int i=0; i != nw; i++) {
+      int x0 = 64*i;
+      int x1 = min(sx, x0 + 64);
+      uint64_t a = ra[i], p = rp[i];
+      if(!(a | p)) {
+	memset(c + x0, 0, x1 - x0);
+	continue;
+      }
+      uint64_t bc = rb[i];
+      for(int x = x0; x != x1; x++) {
+	uint64_t bit = uint64_t(1) << (63 - (x & 63));
+	if(a & p & bit) {
+	  c[x] = TRANSISTOR+1;
+	  if(bc & bit) {
+	    c[x] |= CHECK;
+	    stack.push_back(int64_t(yy - h0)*sx + x);
+	  } else if(x < 5 || yy < 5 || x >= sx-5 || yy >= sy-5)
+	    c[x] |= CHECK;
+	} else
+	  c[x] = a & bit ? ACTIVE+1 : p & bit ? POLY+1 : 0;
+      }
+    }
+  }
+
+  while(!stack.empty()) {
+    int64_t pos = stack.back();
+    stack.pop_back();
+    int x = pos % sx;
+    int64_t next[4] = { x > 0 ? pos-1 : -1, x < sx-1 ? pos+1 : -1, pos-sx, pos+sx < size ? pos+sx : -1 };
+    for(int i=0; i != 4; i++)
+      if(next[i] >= 0 && cls[next[i]] == TRANSISTOR+1) {
+	cls[next[i]] |= CHECK;
+	stack.push_back(next[i]);
+      }
+  }
+
+  for(int yy = y0; yy != y1; yy++) {
+    unsigned char *c = cls.data() + int64_t(yy - h0)*sx;
+    for(int x=0; x<sx; x++)
+      if(c[x] & CHECK)
+	c[x] = color_active_poly_window(x, yy, active, poly, buried, caps)+1;
+  }
 }
 
-void circuit_set(int x, int y, int cid, circuit_info *ci, circuit_map *dest, int l)
+void active_poly_colorer::operator()(int y, std::vector<cc_run> &runs)
 {
-  if(ci->x0 > x)
-    ci->x0 = x;
-  if(ci->y0 > y)
-    ci->y0 = y;
-  if(ci->x1 < x)
-    ci->x1 = x;
-  if(ci->y1 < y)
-    ci->y1 = y;
-  ci->surface++;
-  dest->s(l, x, y, cid);
+  if(y < y0 || y >= y1)
+    classify(y);
+
+  int sx = active->sx;
+  const unsigned char *c = cls.data() + int64_t(y - h0)*sx;
+  int x = 0;
+  while(x < sx) {
+    uint64_t v;
+    if(x + 8 <= sx) {
+      memcpy(&v, c + x, 8);
+      if(!v) {
+	x += 8;
+	continue;
+      }
+    }
+    if(!c[x]) {
+      x++;
+      continue;
+    }
+    int x0 = x;
+    while(x < sx && c[x] == c[x0])
+      x++;
+    cc_add_run(runs, x0, x-1, c[x0]-1);
+  }
 }
 
-bool circuit_test(int x, int y, int cid, const circuit_map *dest, int l)
+void color_active_gates(int y, std::vector<cc_run> &runs, const pbm *active, const pbm *gates, const pbm *caps)
 {
-  return dest->p(l, x, y) == cid;
+  int nw = active->nw();
+  std::vector<uint64_t> ra(nw), rg(nw), rc(nw), ru(nw);
+  active->row(y, ra.data());
+  gates->row(y, rg.data());
+  if(caps)
+    caps->row(y, rc.data());
+  for(int i=0; i != nw; i++) {
+    assert(!(rg[i] & rc[i]));
+    ru[i] = ra[i] | rg[i] | rc[i];
+  }
+  int x0 = 0, x1;
+  while(pbm::next_run(ru.data(), nw, x0, x1)) {
+    for(int x = x0; x <= x1; x++) {
+      uint64_t bit = uint64_t(1) << (63 - (x & 63));
+      int i = x >> 6;
+      cc_add_run(runs, x, x, rc[i] & bit ? CAPACITOR : ra[i] & bit ? ACTIVE : TRANSISTOR);
+    }
+    x0 = x1+1;
+  }
 }
 
-void build_circuits(time_info &tinfo, boost::function<int(int, int)> color, std::vector<circuit_info> &circuits, circuit_map *dest, int l)
+void color_metal(int y, std::vector<cc_run> &runs, const pbm *metal)
 {
-  for(int y=0; y<dest->sy; y++) {
-    tinfo.tick(y, dest->sy);
-    for(int x=0; x<dest->sx; x++) {
-      if(dest->p(l, x, y) != -1)
-	continue;
-      int c = color(x, y);
-      if(c == -1)
-	continue;
-      int cid = circuits.size();
-      circuits.resize(cid+1);
-      circuit_info *ci = &circuits[cid];
-      ci->type = c;
-      ci->surface = 0;
-      ci->x0 = ci->x1 = x;
-      ci->y0 = ci->y1 = y;
-      ci->net = -1;
-      ci->netp = -1;
-      ci->metal = -1;
-      fill(x, y, dest->sx, dest->sy, c, boost::bind(circuit_set, _1, _2, cid, ci, dest, l), color, boost::bind(circuit_test, _1, _2, cid, dest, l));
-    }
+  int nw = metal->nw();
+  std::vector<uint64_t> rm(nw);
+  metal->row(y, rm.data());
+  int x0 = 0, x1;
+  while(pbm::next_run(rm.data(), nw, x0, x1)) {
+    cc_add_run(runs, x0, x1, METAL);
+    x0 = x1+1;
+  }
+}
+
+// Rows per labeling band.  The bands are labeled on their own and
+// merged at their seams, so that an incremental run only labels again
+// the bands its edits reach.
+enum { LABEL_BAND = 2*CIRCUIT_MAP_TILE };
+
+// First pixel where a gate or capacitor label of a metal gates die
+// sees a metal label, -1 when it sees no metal
+struct gate_touch {
+  int circ, metal, x, y;
+};
+
+// Labels of a band, with its first and last rows of runs for the
+// seams, the neighbor label pairs inside the band for layer 0 and the
+// gate touches of a metal gates die
+struct cc_band {
+  std::vector<cc_label> labels;
+  std::vector<cc_run> first, last;
+  std::vector<std::pair<int, int> > pairs;
+  std::vector<gate_touch> touches;
+  int offset;
+};
+
+// Ids the circuits end up with, indexed by circuit before the clean
+// up.  own is the id of the circuit itself, -1 when disabled, ta and
+// tp the ones its active and poly pixels take.  Without a poly layer
+// tp is empty.
+struct id_tables {
+  std::vector<int> own, ta, tp;
+};
+
+// A pair of terminals of a gate, as indices in its groups
+struct gate_trans {
+  int j, k, x, y;
+  double strength;
+};
+
+// A gate with its terminal groups, each stored as its size times two
+// plus the terminal flag followed by its circuits, and its transistors
+struct gate_state {
+  int id, x0, y0, x1, y1;
+  std::vector<int> groups;
+  std::vector<gate_trans> trans;
+};
+
+// What a run keeps for the next one: the labels of the layer 0
+// (phase 0) and metal (phase 1) bands, the ids they end up with and
+// the gates.  n0 is the number of layer 0 circuits.
+struct extract_state {
+  int n0, nvirt;
+  std::vector<cc_band> bands[2];
+  id_tables ids;
+  std::vector<gate_state> gates;
+};
+
+// The previous run, for an incremental one.  Only the dirty bands are
+// labeled again, the others keep their labels and their pixels in the
+// labels file.  offsets and cids are the previous circuits of the
+// labels.  rewrite flags the bands whose ids changed, changed the
+// blocks of CHANGED_BLOCK pixels where a circuit may be more than
+// renumbered, inv gives the previous id of each circuit.  With a raw
+// map the map is updated in place.
+struct previous_run {
+  enum { CHANGED_BLOCK = 16 };
+  bool in_place;
+  circuit_map_tiled_reader labels;
+  extract_state st;
+  std::vector<int> offsets[2], cids[2];
+  std::vector<char> dirty, rewrite, changed;
+  std::vector<int> inv, gate_index;
+  int sx, sy, bx;
+
+  void mark(int x0, int y0, int x1, int y1);
+  bool clean(int x0, int y0, int x1, int y1) const;
+};
+
+previous_run *previous = NULL;
+
+static bool relabeled(int band)
+{
+  return !previous || previous->dirty[band];
+}
+
+void previous_run::mark(int x0, int y0, int x1, int y1)
+{
+  for(int y = y0/CHANGED_BLOCK; y <= y1/CHANGED_BLOCK; y++)
+    for(int x = x0/CHANGED_BLOCK; x <= x1/CHANGED_BLOCK; x++)
+      changed[y*bx + x] = 1;
+}
+
+// False also when the area leaves the die
+bool previous_run::clean(int x0, int y0, int x1, int y1) const
+{
+  if(x0 < 0 || y0 < 0 || x1 >= sx || y1 >= sy)
+    return false;
+  for(int y = y0/CHANGED_BLOCK; y <= y1/CHANGED_BLOCK; y++)
+    for(int x = x0/CHANGED_BLOCK; x <= x1/CHANGED_BLOCK; x++)
+      if(changed[y*bx + x])
+	return false;
+  return true;
+}
+
+static int cc_find(std::vector<cc_label> &labels, int l)
+{
+  while(labels[l].parent != l) {
+    labels[l].parent = labels[labels[l].parent].parent;
+    l = labels[l].parent;
   }
+  return l;
+}
+
+// The lowest label, created first, stays the root
+static void cc_union(std::vector<cc_label> &labels, int a, int b)
+{
+  a = cc_find(labels, a);
+  b = cc_find(labels, b);
+  if(a < b)
+    labels[b].parent = a;
+  else if(b < a)
+    labels[a].parent = b;
+}
+
+// Neighbors are the circuits 4-connected to the pixels of rows 1 to
+// sy-2 and columns 1 to sx-2, except active and poly for each other.
+// Runs of the same type that touch are in the same circuit, the pairs
+// of the others are added both ways when the pixel they start from is
+// in the range.
+static void cc_pair(std::vector<std::pair<int, int> > &pairs, const cc_run &a, const cc_run &b, int oa, int ob, bool a_ok, bool b_ok)
+{
+  if(a.type == b.type || (a.type == ACTIVE && b.type == POLY) || (a.type == POLY && b.type == ACTIVE))
+    return;
+  if(a_ok)
+    pairs.push_back(std::make_pair(oa + a.label, ob + b.label));
+  if(b_ok)
+    pairs.push_back(std::make_pair(ob + b.label, oa + a.label));
+}
+
+// Pairs within the runs of row y
+static void cc_row_pairs(std::vector<std::pair<int, int> > &pairs, const std::vector<cc_run> &runs, int y, int sx, int sy)
+{
+  if(y < 1 || y > sy-2)
+    return;
+  for(unsigned int i=1; i < runs.size(); i++)
+    if(runs[i-1].x1+1 == runs[i].x0) {
+      int x = runs[i].x0;
+      cc_pair(pairs, runs[i-1], runs[i], 0, 0, x-1 >= 1 && x-1 <= sx-2, x <= sx-2);
+    }
 }
 
-static void build_neighbors_add(std::vector<circuit_info> &circuits, int cm, int x, int y, int cn)
+// Pairs between the runs up of row y, labels offset by ou, and the
+// runs down of row y+1, offset by od
+static void cc_rows_pairs(std::vector<std::pair<int, int> > &pairs, const std::vector<cc_run> &up, const std::vector<cc_run> &down, int ou, int od, int y, int sx, int sy)
 {
-  if(cn == -1 || cn == cm)
+  bool up_ok = y >= 1 && y <= sy-2;
+  bool down_ok = y+1 <= sy-2;
+  if(!up_ok && !down_ok)
     return;
-  int cmt = circuits[cm].type;
-  int cnt = circuits[cn].type;
-  if((cmt == ACTIVE && cnt != POLY) || (cmt == POLY && cnt != ACTIVE) || (cmt != POLY && cmt != ACTIVE))
-    circuits[cm].neighbors.insert(cn);
+  unsigned int j = 0;
+  for(const cc_run &r : down) {
+    while(j != up.size() && up[j].x1 < r.x0)
+      j++;
+    for(unsigned int k = j; k != up.size() && up[k].x0 <= r.x1; k++)
+      if(max(max(up[k].x0, r.x0), 1) <= min(min(up[k].x1, r.x1), sx-2))
+	cc_pair(pairs, up[k], r, ou, od, up_ok, down_ok);
+  }
+}
+
+// The band works on its own copy of the colorer, which may keep state
+static void cc_label_band(boost::function<void(int, std::vector<cc_run> &)> color, circuit_map *dest, int l, int y0, int y1, cc_band &band, bool pairs)
+{
+  std::vector<cc_label> &labels = band.labels;
+  std::vector<cc_run> prev, cur;
+  map_sweep sw(*dest, y0);
+
+  for(int y=y0; y<y1; y++) {
+    cur.clear();
+    color(y, cur);
+    int j = 0;
+    for(cc_run &r : cur) {
+      int x0 = r.x0;
+      int x1 = r.x1;
+      int c = r.type;
+
+      while(j != int(prev.size()) && prev[j].x1 < x0)
+	j++;
+      int label = -1;
+      for(int k = j; k != int(prev.size()) && prev[k].x0 <= x1; k++)
+	if(prev[k].type == c) {
+	  if(label == -1)
+	    label = prev[k].label;
+	  else
+	    cc_union(labels, label, prev[k].label);
+	}
+
+      if(label == -1) {
+	label = labels.size();
+	labels.resize(label+1);
+	cc_label &lb = labels[label];
+	lb.parent = label;
+	lb.type = c;
+	lb.surface = 0;
+	lb.x0 = x0;
+	lb.x1 = x1;
+	lb.y0 = lb.y1 = y;
+      }
+      cc_label &lb = labels[label];
+      lb.surface += x1-x0+1;
+      if(lb.x0 > x0)
+	lb.x0 = x0;
+      if(lb.x1 < x1)
+	lb.x1 = x1;
+      lb.y1 = y;
+
+      for(int xx = x0; xx <= x1; xx++)
+	dest->s(l, xx, y, label);
+      r.label = label;
+    }
+    if(pairs) {
+      cc_row_pairs(band.pairs, cur, y, dest->sx, dest->sy);
+      if(y != y0)
+	cc_rows_pairs(band.pairs, prev, cur, 0, 0, y-1, dest->sx, dest->sy);
+    }
+    if(y == y0)
+      band.first = cur;
+    prev.swap(cur);
+    sw.done(y+1);
+  }
+  band.last = prev;
+  std::sort(band.pairs.begin(), band.pairs.end());
+  band.pairs.erase(std::unique(band.pairs.begin(), band.pairs.end()), band.pairs.end());
+}
+
+// Label layer l of the bands of a phase into the map, with the
+// neighbor pairs for layer 0.  An incremental run takes the bands that
+// are not dirty from the previous one.
+static void label_bands(time_info &tinfo, boost::function<void(int, std::vector<cc_run> &)> color, circuit_map &cmap, int l, int phase, std::vector<cc_band> &bands)
+{
+  int nb = (cmap.sy + LABEL_BAND - 1) / LABEL_BAND;
+  if(previous)
+    bands.swap(previous->st.bands[phase]);
+  else
+    bands.resize(nb);
+  std::vector<int> list;
+  for(int b=0; b != nb; b++)
+    if(relabeled(b))
+      list.push_back(b);
+  parallel_items(list.size(), 1, [&](int i, int thread) {
+      if(!thread)
+	tinfo.tick(i, list.size());
+      int b = list[i];
+      int y0 = b*LABEL_BAND;
+      int y1 = min(cmap.sy, y0 + LABEL_BAND);
+      if(previous && previous->in_place)
+	for(int64_t p = int64_t(y0)*cmap.sx; p != int64_t(y1)*cmap.sx; p++)
+	  cmap.data[p*cmap.nl + l] = -1;
+      bands[b] = cc_band();
+      cc_label_band(color, &cmap, l, y0, y1, bands[b], l == 0);
+    });
+  if(!list.empty())
+    tinfo.tick(list.size()-1, list.size());
+}
+
+// On a metal gates die, list in each labeled band the first pixel
+// where each gate or capacitor label sees each metal label or no metal
+static void gate_touches(const circuit_map &cmap, std::vector<cc_band> &gbands, std::vector<cc_band> &mbands)
+{
+  std::vector<int> list;
+  for(unsigned int b=0; b != gbands.size(); b++)
+    if(relabeled(b))
+      list.push_back(b);
+  parallel_items(list.size(), 1, [&](int i, int thread) {
+      int b = list[i];
+      std::vector<cc_label> &gl = gbands[b].labels;
+      std::vector<cc_label> &ml = mbands[b].labels;
+      std::unordered_set<uint64_t> seen;
+      int y0 = b*LABEL_BAND;
+      int y1 = min(cmap.sy, y0 + LABEL_BAND);
+      map_sweep sw(cmap, y0);
+      for(int y=y0; y<y1; y++) {
+	for(int x=0; x<cmap.sx; x++) {
+	  int ca = cmap.p(0, x, y);
+	  if(ca == -1 || (gl[ca].type != TRANSISTOR && gl[ca].type != CAPACITOR))
+	    continue;
+	  int cm = cmap.p(1, x, y);
+	  gate_touch gt;
+	  gt.circ = cc_find(gl, ca);
+	  gt.metal = cm == -1 ? -1 : cc_find(ml, cm);
+	  gt.x = x;
+	  gt.y = y;
+	  if(seen.insert((uint64_t(uint32_t(gt.circ)) << 32) | uint32_t(gt.metal)).second)
+	    gbands[b].touches.push_back(gt);
+	}
+	sw.done(y+1);
+      }
+    });
 }
 
-void build_neighbors(time_info &tinfo, std::vector<circuit_info> &circuits, const circuit_map &cmap)
+// Put the band labels end to end, which keeps them in order of first
+// pixel, and merge the runs on each side of the seams.  The circuits,
+// numbered from base, go to circuits when given, cids gets the id of
+// each label.  Returns the number of circuits.
+static int cc_merge(std::vector<cc_band> &bands, int base, std::vector<int> &cids, std::vector<circuit_info> *circuits)
 {
-  for(int y=1; y<cmap.sy-1; y++) {
-    tinfo.tick(y-1, cmap.sy-2);
-    for(int x=1; x<cmap.sx-1; x++) {
-      int cm = cmap.p(0, x, y);
-      if(cm == -1)
+  std::vector<cc_label> labels;
+  for(cc_band &band : bands) {
+    band.offset = labels.size();
+    for(cc_label lb : band.labels) {
+      lb.parent += band.offset;
+      labels.push_back(lb);
+    }
+  }
+
+  for(unsigned int b=1; b < bands.size(); b++) {
+    const std::vector<cc_run> &up = bands[b-1].last;
+    const std::vector<cc_run> &down = bands[b].first;
+    int j = 0;
+    for(const cc_run &r : down) {
+      while(j != int(up.size()) && up[j].x1 < r.x0)
+	j++;
+      for(int k = j; k != int(up.size()) && up[k].x0 <= r.x1; k++)
+	if(up[k].type == r.type)
+	  cc_union(labels, bands[b-1].offset + up[k].label, bands[b].offset + r.label);
+    }
+  }
+
+  // Roots come before the rest of their set
+  int n = 0;
+  cids.resize(labels.size());
+  for(unsigned int i=0; i != labels.size(); i++) {
+    const cc_label &lb = labels[i];
+    int root = cc_find(labels, i);
+    if(root == int(i)) {
+      cids[i] = base + n++;
+      if(!circuits)
+	continue;
+      circuits->resize(cids[i]+1);
+      circuit_info &ci = circuits->back();
+      ci.type = lb.type;
+      ci.surface = lb.surface;
+      ci.x0 = lb.x0;
+      ci.y0 = lb.y0;
+      ci.x1 = lb.x1;
+      ci.y1 = lb.y1;
+      ci.net = -1;
+      ci.netp = -1;
+      ci.metal = -1;
+    } else {
+      cids[i] = cids[root];
+      if(!circuits)
 	continue;
-      build_neighbors_add(circuits, cm, x-1, y, cmap.p(0, x-1, y));
-      build_neighbors_add(circuits, cm, x+1, y, cmap.p(0, x+1, y));
-      build_neighbors_add(circuits, cm, x, y-1, cmap.p(0, x, y-1));
-      build_neighbors_add(circuits, cm, x, y+1, cmap.p(0, x, y+1));
+      circuit_info &ci = (*circuits)[cids[i]];
+      ci.surface += lb.surface;
+      if(ci.x0 > lb.x0)
+	ci.x0 = lb.x0;
+      if(ci.y0 > lb.y0)
+	ci.y0 = lb.y0;
+      if(ci.x1 < lb.x1)
+	ci.x1 = lb.x1;
+      if(ci.y1 < lb.y1)
+	ci.y1 = lb.y1;
     }
   }
+  return n;
+}
+
+// The neighbor lists come from the label pairs of the bands and the
+// ones across the seams, then are sorted and deduplicated
+void build_neighbors(time_info &tinfo, std::vector<circuit_info> &circuits, const std::vector<cc_band> &bands, const std::vector<int> &cids, int sx, int sy)
+{
+  for(unsigned int b=0; b != bands.size(); b++) {
+    tinfo.tick(b, bands.size());
+    const int *ids = cids.data() + bands[b].offset;
+    for(const auto &p : bands[b].pairs)
+      if(ids[p.first] != ids[p.second])
+	circuits[ids[p.first]].neighbors.push_back(ids[p.second]);
+    if(b) {
+      std::vector<std::pair<int, int> > seam;
+      cc_rows_pairs(seam, bands[b-1].last, bands[b].first, bands[b-1].offset, bands[b].offset, b*LABEL_BAND-1, sx, sy);
+      for(const auto &p : seam)
+	if(cids[p.first] != cids[p.second])
+	  circuits[cids[p.first]].neighbors.push_back(cids[p.second]);
+    }
+  }
+
+  parallel_rows(circuits.size(), [&](int c0, int c1, int b) {
+      for(int i=c0; i != c1; i++) {
+	std::vector<int> &n = circuits[i].neighbors;
+	std::sort(n.begin(), n.end());
+	n.erase(std::unique(n.begin(), n.end()), n.end());
+      }
+    });
+}
+
+static bool has_neighbor(const circuit_info &ci, int id)
+{
+  return std::binary_search(ci.neighbors.begin(), ci.neighbors.end(), id);
+}
+
+static void add_neighbor(circuit_info &ci, int id)
+{
+  std::vector<int>::iterator i = std::lower_bound(ci.neighbors.begin(), ci.neighbors.end(), id);
+  if(i == ci.neighbors.end() || *i != id)
+    ci.neighbors.insert(i, id);
 }
 
 void build_transistor_groups(std::vector<set<int> > &groups, int &terminaux, int &gates, std::vector<bool> &is_terminal, std::vector<bool> &is_gate, const std::vector<circuit_info> &circuits, int id)
@@ -302,14 +982,14 @@ void build_transistor_groups(std::vector<set<int> > &groups, int &terminaux, int
   terminaux = 0;
   gates = 0;
   for(int step=0; step<2; step++) {
-    for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+    for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
       const circuit_info &ci1 = circuits[*j];
       if(step ^ (ci1.type != BURIED && ci1.type != CAPACITOR))
 	continue;
       std::vector<set<int> >::iterator l;
       for(l = groups.begin(); l != groups.end(); l++) {
 	for(set<int>::const_iterator k = l->begin(); k != l->end(); k++)
-	  if(ci1.neighbors.find(*k) != ci1.neighbors.end()) {
+	  if(has_neighbor(ci1, *k)) {
 	    const circuit_info &ci2 = circuits[*k];
 	    if(!((ci1.type == ACTIVE && ci2.type == POLY) || (ci1.type == POLY && ci2.type == ACTIVE)))
 	      goto found;
@@ -338,13 +1018,17 @@ void build_transistor_groups(std::vector<set<int> > &groups, int &terminaux, int
   }
 }
 
-void clean_and_remap(time_info &tinfo, std::vector<circuit_info> &circuits, circuit_map &cmap)
+// Disables the transistors with less than two terminals and computes
+// the ids the active (remap_active) and poly (remap_poly) layers of
+// each circuit pixel take.  The map itself is rewritten by write_map,
+// with the id compression.
+void clean_and_remap(time_info &tinfo, std::vector<circuit_info> &circuits, std::vector<int> &remap_active, std::vector<int> &remap_poly)
 {
   bool has_error = false;
 
   int nc = circuits.size();
-  int *remap_active = new int[nc];
-  int *remap_poly   = new int[nc];
+  remap_active.resize(nc);
+  remap_poly.resize(nc);
 
   for(unsigned int i=0; i != circuits.size(); i++) {
     tinfo.tick(i, circuits.size());
@@ -376,16 +1060,37 @@ void clean_and_remap(time_info &tinfo, std::vector<circuit_info> &circuits, circ
       int terminaux, gates;
       build_transistor_groups(groups, terminaux, gates, is_terminal, is_gate, circuits, i);
       if(terminaux < 2) { //  || (ci.x0 - ci.x1 <= 2 && ci.x0 - ci.x1 >= -2) || (ci.y0 - ci.y1 <= 2 && ci.y0 - ci.y1 >= -2)) {
-	if(terminaux == 0 || gates == 0) {
-	  fprintf(stderr, "P/A superposition zone (%d, %d)-(%d, %d) has no active %s\n", ci.x0, ci.y1, ci.x1, ci.y0, terminaux ? "gate" : "terminal");
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	if((terminaux == 0 || gates == 0) && roi.border(ci)) {
+	  // Cut by the crop, fold it in whatever it still touches
+	  int pmap = -1, amap = -1;
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	    int t = circuits[*j].type;
+	    if(t == ACTIVE || t == BURIED)
+	      amap = *j;
+	    if(t == POLY || t == BURIED)
+	      pmap = *j;
+	  }
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	    if(amap != -1)
+	      add_neighbor(circuits[amap], *j);
+	    if(pmap != -1)
+	      add_neighbor(circuits[pmap], *j);
+	  }
+	  ci.type = DISABLED;
+	  ci.neighbors.clear();
+	  remap_active[i] = amap;
+	  remap_poly[i] = pmap;
+
+	} else if(terminaux == 0 || gates == 0) {
+	  fprintf(stderr, "P/A superposition zone (%d, %d)-(%d, %d) has no active %s\n", ci.x0+roi.x, ci.y1+roi.y, ci.x1+roi.x, ci.y0+roi.y, terminaux ? "gate" : "terminal");
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
 	    const circuit_info &ci1 = circuits[*j];
-	    fprintf(stderr, "  - %c%d (%d, %d)-(%d, %d)\n", type_names[ci1.type], *j, ci1.x0, ci1.y1, ci1.x1, ci1.y0);
+	    fprintf(stderr, "  - %c%d (%d, %d)-(%d, %d)\n", type_names[ci1.type], *j, ci1.x0+roi.x, ci1.y1+roi.y, ci1.x1+roi.x, ci1.y0+roi.y);
 	  }
 	  has_error = true;
 	} else {
 	  int pmap = -1, amap = -1;
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
 	    int t = circuits[*j].type;
 	    switch(t) {
 	    case ACTIVE: amap = *j; break;
@@ -394,13 +1099,13 @@ void clean_and_remap(time_info &tinfo, std::vector<circuit_info> &circuits, circ
 	    }
 	  }
 	  if(amap == -1 || pmap == -1) {
-	    fprintf(stderr, "Bad a/pmap on clean-and-remap (%d, %d)-(%d, %d)\n", ci.x0, ci.y1, ci.x1, ci.y0);
+	    fprintf(stderr, "Bad a/pmap on clean-and-remap (%d, %d)-(%d, %d)\n", ci.x0+roi.x, ci.y1+roi.y, ci.x1+roi.x, ci.y0+roi.y);
 	    has_error = true;
 	    break;
 	  }
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
-	    circuits[amap].neighbors.insert(*j);
-	    circuits[pmap].neighbors.insert(*j);
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	    add_neighbor(circuits[amap], *j);
+	    add_neighbor(circuits[pmap], *j);
 	  }
 
 	  ci.type = DISABLED;
@@ -420,269 +1125,523 @@ void clean_and_remap(time_info &tinfo, std::vector<circuit_info> &circuits, circ
   if(has_error)
     exit(1);
 
-  for(int y=0; y<cmap.sy; y++) {
-    tinfo.tick(y, cmap.sy);
-    for(int x=0; x<cmap.sx; x++) {
-      int v = cmap.p(0, x, y);
-      if(v != -1) {
-	cmap.s(0, x, y, remap_active[v]);
-	cmap.s(1, x, y, remap_poly[v]);
-      }
-    }
-  }
-
-  for(unsigned int i=0; i != circuits.size(); i++) {
-    circuit_info &ci = circuits[i];
-  retry:
-    for(set<int>::iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
-      if(remap_active[*j] != -1 && remap_active[*j] != *j) {
-	int rm = ci.type == ACTIVE ? remap_active[*j] : remap_poly[*j];
-	ci.neighbors.erase(j);
-	ci.neighbors.insert(rm);
-	goto retry;
+  // Neighbors that were disabled are replaced by what they were merged in
+  parallel_rows(circuits.size(), [&](int c0, int c1, int b) {
+      for(int i=c0; i != c1; i++) {
+	circuit_info &ci = circuits[i];
+	const std::vector<int> &remap = ci.type == ACTIVE ? remap_active : remap_poly;
+	bool changed = false;
+	unsigned int k = 0;
+	for(unsigned int j=0; j != ci.neighbors.size(); j++) {
+	  int id = ci.neighbors[j];
+	  if(circuits[id].type == DISABLED) {
+	    changed = true;
+	    id = remap[id];
+	    if(id == -1)
+	      continue;
+	  }
+	  ci.neighbors[k++] = id;
+	}
+	ci.neighbors.resize(k);
+	if(changed) {
+	  std::sort(ci.neighbors.begin(), ci.neighbors.end());
+	  ci.neighbors.erase(std::unique(ci.neighbors.begin(), ci.neighbors.end()), ci.neighbors.end());
+	}
       }
-  }
+    });
 }
 
-void compress_ids(time_info &tinfo, std::vector<circuit_info> &circuit_infos, std::vector<metal_link_info> &virtual_poly_id, circuit_map &cmap)
+// The layer 0 circuits go through remap_active/remap_poly then the
+// compression, the other ones only through the compression.  The
+// results are kept as tables for write_map to apply to the labels.
+void compress_ids(time_info &tinfo, std::vector<circuit_info> &circuit_infos, std::vector<metal_link_info> &virtual_poly_id, const std::vector<int> &remap_active, const std::vector<int> &remap_poly, id_tables &ids)
 {
+  int nc = circuit_infos.size();
   std::vector<int> remap;
-  remap.resize(circuit_infos.size());
+  remap.resize(nc);
+  ids.own.resize(nc);
   unsigned int cid = 0;
-  for(unsigned int i=0; i != circuit_infos.size(); i++) {
+  for(int i=0; i != nc; i++) {
     remap[i] = cid;
+    ids.own[i] = -1;
     if(circuit_infos[i].type != DISABLED) {
-      if(cid != i)
+      ids.own[i] = cid;
+      if(int(cid) != i)
 	circuit_infos[cid] = circuit_infos[i];
       cid++;
     }
   }
   circuit_infos.resize(cid);
 
-  for(int y=0; y<cmap.sy; y++) {
-    tinfo.tick(y, cmap.sy);
-    for(int x=0; x<cmap.sx; x++)
-      for(int l=0; l<3; l++) {
-	int v = cmap.p(l, x, y);
-	if(v != -1)
-	  cmap.s(l, x, y, remap[v]);
-      }
+  ids.ta.resize(nc);
+  ids.tp.resize(nc);
+  for(int i=0; i != nc; i++) {
+    ids.ta[i] = remap_active[i] == -1 ? -1 : remap[remap_active[i]];
+    ids.tp[i] = remap_poly[i] == -1 ? -1 : remap[remap_poly[i]];
   }
 
   for(std::vector<metal_link_info>::iterator i = virtual_poly_id.begin(); i != virtual_poly_id.end(); i++)
     i->circuit_id = remap[i->circuit_id];
 
-  for(unsigned int i=0; i != circuit_infos.size(); i++) {
-    circuit_info &ci = circuit_infos[i];
-    set<int> re;
-    for(set<int>::const_iterator i = ci.neighbors.begin(); i != ci.neighbors.end(); i++)
-      re.insert(remap[*i]);
-    ci.neighbors = re;
+  // No neighbor is disabled and remap keeps the order of the others,
+  // so the lists stay sorted
+  parallel_rows(circuit_infos.size(), [&](int c0, int c1, int b) {
+      for(int i=c0; i != c1; i++)
+	for(int &j : circuit_infos[i].neighbors)
+	  j = remap[j];
+    });
+}
+
+// Ties the circuits to the ones of the previous run.  A circuit stays
+// the same when it is made of the same labels, all in bands that were
+// not labeled again.  Flags the bands where the ids of the labels
+// changed, and the blocks where a layer 0 pixel may have changed
+// circuit beyond a renumbering.
+static void match_previous(const extract_state &st, const std::vector<int> *cids, int ncircuits)
+{
+  previous_run &pr = *previous;
+  const extract_state &os = pr.st;
+  int nb = st.bands[0].size();
+  int nco = os.ids.own.size();
+
+  std::vector<int> match(nco, -1), count(nco, 0), ncount(st.ids.own.size(), 0);
+  for(int p=0; p != 2; p++) {
+    for(int c : cids[p])
+      ncount[c]++;
+    for(int b=0; b != nb; b++) {
+      const int *oc = pr.cids[p].data() + pr.offsets[p][b];
+      int nl = pr.offsets[p][b+1] - pr.offsets[p][b];
+      if(pr.dirty[b]) {
+	for(int l=0; l != nl; l++)
+	  match[oc[l]] = -2;
+	continue;
+      }
+      const int *nc = cids[p].data() + st.bands[p][b].offset;
+      for(int l=0; l != nl; l++) {
+	int o = oc[l];
+	if(match[o] == -1)
+	  match[o] = nc[l];
+	else if(match[o] != nc[l])
+	  match[o] = -2;
+	count[o]++;
+      }
+    }
+  }
+
+  int nfo = 0;
+  for(int id : os.ids.own)
+    nfo = max(nfo, id+1);
+  std::vector<int> corr(nfo, -2);
+  auto link = [&](int o, int n) {
+    int fo = os.ids.own[o];
+    int fn = st.ids.own[n];
+    if(fo != -1 && fn != -1)
+      corr[fo] = fn;
+  };
+  for(int o=0; o != nco; o++)
+    if(match[o] >= 0 && count[o] == ncount[match[o]])
+      link(o, match[o]);
+  for(int k=0; k != st.nvirt; k++)
+    link(os.n0 + k, st.n0 + k);
+
+  pr.inv.assign(ncircuits, -1);
+  for(int fo=0; fo != nfo; fo++)
+    if(corr[fo] >= 0)
+      pr.inv[corr[fo]] = fo;
+
+  pr.bx = (pr.sx + previous_run::CHANGED_BLOCK - 1) / previous_run::CHANGED_BLOCK;
+  int by = (pr.sy + previous_run::CHANGED_BLOCK - 1) / previous_run::CHANGED_BLOCK;
+  pr.changed.assign(int64_t(pr.bx)*by, 0);
+  pr.rewrite.assign(nb, 0);
+  for(int b=0; b != nb; b++) {
+    if(pr.dirty[b]) {
+      pr.mark(0, b*LABEL_BAND, pr.sx-1, min(pr.sy, (b+1)*LABEL_BAND)-1);
+      continue;
+    }
+    const std::vector<cc_label> &labels = st.bands[0][b].labels;
+    const int *oc = pr.cids[0].data() + pr.offsets[0][b];
+    const int *nc = cids[0].data() + st.bands[0][b].offset;
+    for(unsigned int l=0; l != labels.size(); l++) {
+      int oa = os.ids.ta[oc[l]];
+      int na = st.ids.ta[nc[l]];
+      if(oa != na || (!st.ids.tp.empty() && os.ids.tp[oc[l]] != st.ids.tp[nc[l]]))
+	pr.rewrite[b] = 1;
+      if((oa == -1 ? -1 : corr[oa]) != na)
+	pr.mark(labels[l].x0, labels[l].y0, labels[l].x1, labels[l].y1);
+    }
+    oc = pr.cids[1].data() + pr.offsets[1][b];
+    nc = cids[1].data() + st.bands[1][b].offset;
+    for(unsigned int l=0; l != st.bands[1][b].labels.size(); l++)
+      if(os.ids.own[oc[l]] != st.ids.own[nc[l]])
+	pr.rewrite[b] = 1;
   }
 }
 
-void map_vias_set(int x, int y, via_info *via, const std::vector<circuit_info> *circuit_infos, pbm *used, circuit_map *cmap)
+// The labels go to the labels file for the next run, then through the
+// id tables into the map, layer 0 into the active and poly layers.  An
+// incremental run writes the labels of the bands it did not label
+// again as they were, and on a raw map only rewrites the bands it
+// labeled and the ones where the ids changed.
+static void write_map(time_info &tinfo, circuit_map &cmap, const extract_state &st, const std::vector<int> *cids, const char *labels_name)
 {
-  used->s(x, y, true);
-  int na = cmap->p(0, x, y);
-  int np = cmap->nl >= 3 ? cmap->p(1, x, y) : -1;
-  int nm = cmap->p(cmap->nl >= 3 ? 2 : 1, x, y);
+  int nl = cmap.nl, sx = cmap.sx, sy = cmap.sy;
+  int ml = nl - 1;
+  int nb = st.bands[0].size();
+
+  circuit_map_tiled_writer w(labels_name, 2, sx, sy);
+  std::vector<int> rows(2*int64_t(sx)*CIRCUIT_MAP_TILE);
+  for(int y0=0; y0 < sy; y0 += CIRCUIT_MAP_TILE) {
+    if(!relabeled(y0 / LABEL_BAND)) {
+      w.copy_band(previous->labels);
+      continue;
+    }
+    int y1 = min(sy, y0 + int(CIRCUIT_MAP_TILE));
+    int *r = rows.data();
+    for(int y=y0; y != y1; y++) {
+      const int *d = cmap.data + int64_t(nl)*sx*y;
+      for(int x=0; x != sx; x++, d += nl, r += 2) {
+	r[0] = d[0];
+	r[1] = d[ml];
+      }
+    }
+    w.add_band(rows.data());
+    cmap.release_rows(y0, y1);
+  }
+  w.close();
+
+  std::vector<int> list;
+  for(int b=0; b != nb; b++)
+    if(!previous || !previous->in_place || previous->dirty[b] || previous->rewrite[b])
+      list.push_back(b);
+  parallel_items(list.size(), 1, [&](int i, int thread) {
+      if(!thread)
+	tinfo.tick(i, list.size());
+      int b = list[i];
+      const cc_band &b0 = st.bands[0][b];
+      const cc_band &b1 = st.bands[1][b];
+      // Indexed by label+1, so that -1 needs no test
+      std::vector<int> ta(b0.labels.size()+1), tp(b0.labels.size()+1), tm(b1.labels.size()+1);
+      ta[0] = tp[0] = tm[0] = -1;
+      for(unsigned int l=0; l != b0.labels.size(); l++) {
+	int c = cids[0][b0.offset + l];
+	ta[l+1] = st.ids.ta[c];
+	tp[l+1] = st.ids.tp.empty() ? -1 : st.ids.tp[c];
+      }
+      for(unsigned int l=0; l != b1.labels.size(); l++)
+	tm[l+1] = st.ids.own[cids[1][b1.offset + l]];
+
+      int y0 = b*LABEL_BAND;
+      int y1 = min(sy, y0 + LABEL_BAND);
+      std::vector<int> old;
+      if(!relabeled(b)) {
+	old.resize(2*int64_t(sx)*(y1-y0));
+	for(int y=y0; y < y1; y += CIRCUIT_MAP_TILE)
+	  previous->labels.read_band(y / CIRCUIT_MAP_TILE, old.data() + 2*int64_t(sx)*(y-y0));
+      }
+
+      const int *a = ta.data() + 1, *p = tp.data() + 1, *m = tm.data() + 1;
+      map_sweep sw(cmap, y0);
+      for(int y=y0; y<y1; y++) {
+	int *d = cmap.data + int64_t(nl)*sx*y;
+	const int *s = old.empty() ? NULL : old.data() + 2*int64_t(sx)*(y-y0);
+	for(int x=0; x != sx; x++, d += nl) {
+	  int l0 = s ? s[2*x] : d[0];
+	  int lm = s ? s[2*x+1] : d[ml];
+	  d[0] = a[l0];
+	  if(nl == 3)
+	    d[1] = p[l0];
+	  d[ml] = m[lm];
+	}
+	sw.done(y+1);
+      }
+    });
+  if(!list.empty())
+    tinfo.tick(list.size()-1, list.size());
+}
+
+// Diagnostic on a via pixel, printed with the others of the via
+struct via_msg {
+  int via, x, y;
+  const char *msg;
+};
+
+static void map_vias_pixel(int x, int y, int v, const int *d, int nl, via_info &via, const std::vector<circuit_info> &circuit_infos, std::vector<via_msg> &msgs)
+{
+  int na = d[0];
+  int np = nl >= 3 ? d[1] : -1;
+  int nm = d[nl >= 3 ? 2 : 1];
+  const char *msg = NULL;
   if(nm != -1) {
-    if(via->metal == -1)
-      via->metal = nm;
-    else if(via->metal != nm)
-      fprintf(stderr, "via at (%d, %d) touches multiple metal tracks\n", x, y);
+    if(via.metal == -1)
+      via.metal = nm;
+    else if(via.metal != nm)
+      msgs.push_back(via_msg { v, x, y, "touches multiple metal tracks" });
   }
   if(na != -1 && np != -1 && na != np)
-    fprintf(stderr, "via at (%d, %d) touches split active/poly\n", x, y);
+    msg = "touches split active/poly";
   else if(na != -1 || np != -1) {
     int nn = na == -1 ? np : na;
-    if((*circuit_infos)[nn].type == TRANSISTOR)
-      fprintf(stderr, "via at (%d, %d) touches a transistor\n", x, y);
-    else if((*circuit_infos)[nn].type == CAPACITOR)
-      fprintf(stderr, "via at (%d, %d) touches a capacitor\n", x, y);
-    else if(via->active_poly == -1)
-      via->active_poly = nn;
-    else if(via->active_poly != nn)
-      fprintf(stderr, "via at (%d, %d) touches multiple poly/layer zones\n", x, y);
-  }
-}
-
-void map_vias(time_info &tinfo, std::vector<via_info> &via_infos, via_map &via_maps, const std::vector<circuit_info> &circuit_infos, const pbm *vias, circuit_map &cmap)
-{
-  pbm used(cmap.sx, cmap.sy);
-  for(int y=0; y<cmap.sy; y++) {
-    tinfo.tick(y, cmap.sy);
-    for(int x=0; x<cmap.sx; x++) {
-      if(vias->p(x, y) && !used.p(x, y)) {
-	via_info via(-1, -1);
-	fill(x, y, cmap.sx, cmap.sy, 1, boost::bind(map_vias_set, _1, _2, &via, &circuit_infos, &used, &cmap), boost::bind(&pbm::p, vias, _1, _2), boost::bind(&pbm::p, &used, _1, _2));
-	if(via.metal == -1)
-	  fprintf(stderr, "via at (%d, %d) does not touch the metal\n", x, y);
-	if(via.active_poly == -1)
-	  fprintf(stderr, "via at (%d, %d) does not touch poly or active\n", x, y);
-
-	if(0 && x > 7450 && x < 7500)
-	  continue;
-	//	if(x >= 1000 && x < 4000 && y > 250 && y < 500) {
-	//	  continue;
-	//	}
-
-	//	if(!(x >= 6000 && x < 6750 && y >= 5000 && y < 6500))
-	//	  continue;
-	if(via.metal != -1 && via.active_poly != -1)
-	  via_infos.push_back(via);
+    if(circuit_infos[nn].type == TRANSISTOR)
+      msg = "touches a transistor";
+    else if(circuit_infos[nn].type == CAPACITOR)
+      msg = "touches a capacitor";
+    else if(via.active_poly == -1)
+      via.active_poly = nn;
+    else if(via.active_poly != nn)
+      msg = "touches multiple poly/layer zones";
+  }
+  if(msg)
+    msgs.push_back(via_msg { v, x, y, msg });
+}
+
+// The vias are labeled by runs as the layers are, without keeping a
+// map.  A second pass over the runs, in raster order, numbers the vias
+// in order of first pixel and picks the first metal and active/poly
+// ids seen under each.  The diagnostics are printed per via, in that
+// order.
+void map_vias(time_info &tinfo, std::vector<via_info> &via_infos, const std::vector<circuit_info> &circuit_infos, const pbm *vias, circuit_map &cmap)
+{
+  int sx = cmap.sx, sy = cmap.sy, nl = cmap.nl;
+  int nw = vias->nw();
+  std::vector<uint64_t> rv(nw);
+  std::vector<cc_label> labels;
+  std::vector<cc_run> runs;
+  std::vector<int> row_start(sy+1);
+
+  map_sweep lsw(cmap, 0);
+  for(int y=0; y<sy; y++) {
+    lsw.done(y);
+    tinfo.tick(y, 2*sy);
+    row_start[y] = runs.size();
+    int p0 = y ? row_start[y-1] : 0;
+    int p1 = row_start[y];
+    vias->row(y, rv.data());
+    int x0 = 0, x1;
+    while(pbm::next_run(rv.data(), nw, x0, x1)) {
+      while(p0 != p1 && runs[p0].x1 < x0)
+	p0++;
+      int label = -1;
+      for(int k = p0; k != p1 && runs[k].x0 <= x1; k++)
+	if(label == -1)
+	  label = runs[k].label;
+	else
+	  cc_union(labels, label, runs[k].label);
+      if(label == -1) {
+	label = labels.size();
+	labels.resize(label+1);
+	labels[label].parent = label;
+      }
+      cc_run r;
+      r.x0 = x0;
+      r.x1 = x1;
+      r.type = 0;
+      r.label = label;
+      runs.push_back(r);
+      x0 = x1+1;
+    }
+  }
+  row_start[sy] = runs.size();
+
+  std::vector<int> via_id(labels.size(), -1);
+  std::vector<via_info> found;
+  std::vector<int> seed_x, seed_y;
+  std::vector<via_msg> msgs;
+  map_sweep sw(cmap, 0);
+  for(int y=0; y<sy; y++) {
+    sw.done(y);
+    tinfo.tick(sy+y, 2*sy);
+    for(int i = row_start[y]; i != row_start[y+1]; i++) {
+      const cc_run &r = runs[i];
+      int root = cc_find(labels, r.label);
+      int v = via_id[root];
+      if(v == -1) {
+	v = via_id[root] = found.size();
+	found.push_back(via_info(-1, -1));
+	seed_x.push_back(r.x0);
+	seed_y.push_back(y);
       }
+      via_info &via = found[v];
+      const int *d = cmap.data + int64_t(nl)*(int64_t(y)*sx + r.x0);
+      for(int x = r.x0; x <= r.x1; x++, d += nl)
+	map_vias_pixel(x, y, v, d, nl, via, circuit_infos, msgs);
     }
   }
 
-  for(unsigned int i=0; i != via_infos.size(); i++) {
-    via_maps.metal_to_ap[via_infos[i].metal].push_back(via_infos[i].active_poly);
-    via_maps.ap_to_metal[via_infos[i].active_poly].push_back(via_infos[i].metal);
+  std::stable_sort(msgs.begin(), msgs.end(), [](const via_msg &a, const via_msg &b) { return a.via < b.via; });
+  unsigned int m = 0;
+  for(unsigned int v=0; v != found.size(); v++) {
+    for(; m != msgs.size() && msgs[m].via == int(v); m++)
+      fprintf(stderr, "via at (%d, %d) %s\n", msgs[m].x+roi.x, msgs[m].y+roi.y, msgs[m].msg);
+    const via_info &via = found[v];
+    if(via.metal == -1)
+      fprintf(stderr, "via at (%d, %d) does not touch the metal\n", seed_x[v]+roi.x, seed_y[v]+roi.y);
+    if(via.active_poly == -1)
+      fprintf(stderr, "via at (%d, %d) does not touch poly or active\n", seed_x[v]+roi.x, seed_y[v]+roi.y);
+    if(via.metal != -1 && via.active_poly != -1)
+      via_infos.push_back(via);
   }
 }
 
-void via_list_add(std::vector<int> &stack, const map<int, std::vector<int> > vmap, int id, const std::vector<circuit_info> &circuit_infos)
+// Group the edges of the vias, virtual ones included, by circuit.
+// Virtual vias with an end off the metal link nothing.
+void build_via_map(via_map &via_maps, const std::vector<via_info> &via_infos, int ncircuits)
 {
-  map<int, std::vector<int> >::const_iterator vi = vmap.find(id);
-  if(vi == vmap.end())
-    return;
-  for(std::vector<int>::const_iterator i = vi->second.begin(); i != vi->second.end(); i++)
-    if(circuit_infos[*i].net == -1)
-      stack.push_back(*i);
+  via_maps.metal_index.assign(ncircuits+1, 0);
+  via_maps.ap_index.assign(ncircuits+1, 0);
+  for(const via_info &via : via_infos) {
+    if(via.metal == -1 || via.active_poly == -1)
+      continue;
+    via_maps.metal_index[via.metal+1]++;
+    via_maps.ap_index[via.active_poly+1]++;
+  }
+  for(int i=0; i != ncircuits; i++) {
+    via_maps.metal_index[i+1] += via_maps.metal_index[i];
+    via_maps.ap_index[i+1] += via_maps.ap_index[i];
+  }
+  via_maps.metal_to_ap.resize(via_maps.metal_index[ncircuits]);
+  via_maps.ap_to_metal.resize(via_maps.ap_index[ncircuits]);
+  std::vector<int> mpos(via_maps.metal_index.begin(), via_maps.metal_index.end()-1);
+  std::vector<int> apos(via_maps.ap_index.begin(), via_maps.ap_index.end()-1);
+  for(const via_info &via : via_infos) {
+    if(via.metal == -1 || via.active_poly == -1)
+      continue;
+    via_maps.metal_to_ap[mpos[via.metal]++] = via.active_poly;
+    via_maps.ap_to_metal[apos[via.active_poly]++] = via.metal;
+  }
+}
+
+// Nodes of the net building are 2*circuit, +1 for the poly side.
+// Only capacitors have distinct active and poly sides.
+void via_list_add(std::vector<int> &queue, const std::vector<int> &index, const std::vector<int> &edges, int id, const std::vector<circuit_info> &circuit_infos)
+{
+  for(int i = index[id]; i != index[id+1]; i++)
+    if(circuit_infos[edges[i]].net == -1)
+      queue.push_back(2 * edges[i]);
 }
 
+// List the circuits of a net, with the nets of ci if given
+static void build_nets_dump(const std::vector<int> &circuits, const circuit_info *ci, const std::vector<circuit_info> &circuit_infos, int sy)
+{
+  std::vector<int> sorted = circuits;
+  std::sort(sorted.begin(), sorted.end());
+  for(std::vector<int>::const_iterator j = sorted.begin(); j != sorted.end(); j++) {
+    const circuit_info &ci1 = circuit_infos[*j % cap_poly_offset];
+    fprintf(stderr, "  - %c%d", type_names[ci1.type], *j);
+    if(ci)
+      fprintf(stderr, " (%d/%d)", ci->net, ci->netp);
+    fprintf(stderr, " (%d, %d)-(%d, %d)", ci1.x0+roi.x, sy-1-ci1.y1+roi.yb, ci1.x1+roi.x, sy-1-ci1.y0+roi.yb);
+    for(std::vector<int>::const_iterator k = ci1.neighbors.begin(); k != ci1.neighbors.end(); k++) {
+      const circuit_info &ci2 = circuit_infos[*k];
+      fprintf(stderr, " %c%d", type_names[ci2.type], *k);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+// Nets are grown breadth-first from each circuit not yet in one.  The
+// links depend on the circuit types and are not always symmetric (the
+// neighbors merged by clean_and_remap are not), so reaching a circuit
+// already in another net is reported as a failure.
 void build_nets(time_info &tinfo, std::vector<net_info> &net_infos, std::vector<circuit_info> &circuit_infos, const via_map &via_maps, bool has_poly, int sx, int sy)
 {
+  cap_poly_offset = 1000000;
+  while(cap_poly_offset < int(circuit_infos.size()) && cap_poly_offset < 1000000000)
+    cap_poly_offset *= 10;
+
+  std::vector<int> queue;
   for(unsigned int i=0; i != circuit_infos.size(); i++) {
-    //    tinfo.tick(i, circuit_infos.size());
+    tinfo.tick(i, circuit_infos.size());
     if(circuit_infos[i].type != DISABLED && circuit_infos[i].net == -1) {
       if(circuit_infos[i].type == CAPACITOR || (circuit_infos[i].type == TRANSISTOR && !has_poly))
 	continue;
       int nid = net_infos.size();
       net_infos.resize(nid+1);
-      set<int> &circuits = net_infos[nid].circuits;
-      std::vector<int> stack;
-      assert(circuit_infos[i].type != CAPACITOR);
-      stack.push_back(i + (circuit_infos[i].type == POLY ? 1000000 : 0));
-      do {
-	int cid = stack.front();
-	int pcid = cid;
-	stack.erase(stack.begin());
-	int start_stack_size = stack.size();
-	int is_poly = cid / 1000000;
-	cid = cid % 1000000;
+      std::vector<int> &circuits = net_infos[nid].circuits;
+      queue.clear();
+      queue.push_back(2*i + (circuit_infos[i].type == POLY ? 1 : 0));
+      for(unsigned int head = 0; head != queue.size(); head++) {
+	int node = queue[head];
+	int is_poly = node & 1;
+	int cid = node >> 1;
 	circuit_info &ci = circuit_infos[cid];
 	int curnet = is_poly && ci.type == CAPACITOR ? ci.netp : ci.net;
 	if(curnet != -1) {
 	  if(curnet != nid) {
-	    fprintf(stderr, "Network creation failure on %c%d (%d, %d)-(%d, %d), nets %d and %d want to link\n", type_names[ci.type], cid, ci.x0, sy-1-ci.y1, ci.x1, sy-1-ci.y0, nid, curnet);
-	    fprintf(stderr, "  pcid=%d\n", pcid);
+	    fprintf(stderr, "Network creation failure on %c%d (%d, %d)-(%d, %d), nets %d and %d want to link\n", type_names[ci.type], cid, ci.x0+roi.x, sy-1-ci.y1+roi.yb, ci.x1+roi.x, sy-1-ci.y0+roi.yb, nid, curnet);
+	    fprintf(stderr, "  pcid=%d\n", cid + (is_poly ? cap_poly_offset : 0));
 	    fprintf(stderr, "  net %d (%d/%d):\n", curnet, ci.net, ci.netp);
-	    for(set<int>::const_iterator j = net_infos[curnet].circuits.begin(); j != net_infos[curnet].circuits.end(); j++) {
-	      const circuit_info &ci1 = circuit_infos[*j];
-	      fprintf(stderr, "  - %c%d (%d/%d) (%d, %d)-(%d, %d)", type_names[ci1.type], *j, ci.net, ci.netp, ci1.x0, sy-1-ci1.y1, ci1.x1, sy-1-ci1.y0);
-	      for(set<int>::const_iterator j = ci1.neighbors.begin(); j != ci1.neighbors.end(); j++) {
-		const circuit_info &ci2 = circuit_infos[*j];
-		fprintf(stderr, " %c%d", type_names[ci2.type], *j);
-	      }
-	      fprintf(stderr, "\n");
-	    }
+	    build_nets_dump(net_infos[curnet].circuits, &ci, circuit_infos, sy);
 	    fprintf(stderr, "  net %d:\n", nid);
-	    for(set<int>::const_iterator j = net_infos[nid].circuits.begin(); j != net_infos[nid].circuits.end(); j++) {
-	      const circuit_info &ci1 = circuit_infos[*j];
-	      fprintf(stderr, "  - %c%d (%d, %d)-(%d, %d)", type_names[ci1.type], *j, ci1.x0, sy-1-ci1.y1, ci1.x1, sy-1-ci1.y0);
-	      for(set<int>::const_iterator j = ci1.neighbors.begin(); j != ci1.neighbors.end(); j++) {
-		const circuit_info &ci2 = circuit_infos[*j];
-		fprintf(stderr, " %c%d", type_names[ci2.type], *j);
-	      }
-	      fprintf(stderr, "\n");
-	    }
+	    build_nets_dump(circuits, NULL, circuit_infos, sy);
 	    exit(1);
 	  }
 	  continue;
 	}
 
-	circuits.insert(cid + (ci.type == CAPACITOR && is_poly ? 1000000 : 0));
+	circuits.push_back(cid + (ci.type == CAPACITOR && is_poly ? cap_poly_offset : 0));
 	if(ci.type == CAPACITOR && is_poly)
 	  ci.netp = nid;
 	else
 	  ci.net = nid;
 	switch(ci.type) {
 	case ACTIVE:
-	  via_list_add(stack, via_maps.ap_to_metal, cid, circuit_infos);
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
+	  via_list_add(queue, via_maps.ap_index, via_maps.ap_to_metal, cid, circuit_infos);
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
 	    if(circuit_infos[*j].type == BURIED || circuit_infos[*j].type == CAPACITOR)
-	      stack.push_back(*j);
+	      queue.push_back(2 * *j);
 	  break;
 
 	case POLY:
-	  via_list_add(stack, via_maps.ap_to_metal, cid, circuit_infos);
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	  via_list_add(queue, via_maps.ap_index, via_maps.ap_to_metal, cid, circuit_infos);
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
 	    int id = *j;
 	    if(circuit_infos[id].net == -1 && (circuit_infos[id].type == BURIED || circuit_infos[id].type == TRANSISTOR))
-	      stack.push_back(id + 1000000);
+	      queue.push_back(2*id + 1);
 	    if(circuit_infos[id].netp == -1 && circuit_infos[id].type == CAPACITOR)
-	      stack.push_back(id + 1000000);
+	      queue.push_back(2*id + 1);
 	  }
 	  break;
 
 	case METAL:
-	  via_list_add(stack, via_maps.metal_to_ap, cid, circuit_infos);
+	  via_list_add(queue, via_maps.metal_index, via_maps.metal_to_ap, cid, circuit_infos);
 	  break;
 
 	case BURIED:
-	  via_list_add(stack, via_maps.ap_to_metal, cid, circuit_infos);
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	  via_list_add(queue, via_maps.ap_index, via_maps.ap_to_metal, cid, circuit_infos);
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
 	    if(circuit_infos[*j].type == ACTIVE || circuit_infos[*j].type == CAPACITOR)
-	      stack.push_back(*j);
+	      queue.push_back(2 * *j);
 	    if(circuit_infos[*j].type == POLY || circuit_infos[*j].type == TRANSISTOR)
-	      stack.push_back(*j + 1000000);
+	      queue.push_back(2 * *j + 1);
 	    if(circuit_infos[*j].type == CAPACITOR)
-	      stack.push_back(*j + 1000000);
+	      queue.push_back(2 * *j + 1);
 	  }
 	  break;
 
 	case TRANSISTOR:
-	  for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
+	  for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++) {
 	    if(circuit_infos[*j].type == BURIED || circuit_infos[*j].type == POLY || circuit_infos[*j].type == CAPACITOR)
-	      stack.push_back(*j + 1000000);
+	      queue.push_back(2 * *j + 1);
 	  }
 	  break;
 
 	case CAPACITOR:
 	  if(is_poly) {
-	    for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
+	    for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
 	      if(circuit_infos[*j].type == BURIED || circuit_infos[*j].type == POLY || circuit_infos[*j].type == TRANSISTOR)
-		stack.push_back(*j + 1000000);
+		queue.push_back(2 * *j + 1);
 	  } else {
-	    for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
+	    for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
 	      if(circuit_infos[*j].type == BURIED || circuit_infos[*j].type == ACTIVE)
-		stack.push_back(*j);
+		queue.push_back(2 * *j);
 	  }
 	  break;
 
 	default:
 	  abort();
 	}
-
-	if(false && !nid) {
-	  std::vector<int>::const_iterator i = stack.begin();
-	  for(int ii=0; ii<start_stack_size; ii++)
-	    i++;
-	  printf("%d:", cid);
-	  for(;i != stack.end();i++)
-	    printf(" %d", *i);
-	  printf("\n");
-	}
-#if 0
-	fprintf(stderr, "  + %c%d %d (%d, %d)-(%d, %d)", type_names[ci.type], cid, is_poly, ci.x0, ci.y1, ci.x1, ci.y0);
-	fprintf(stderr, "    ");
-	for(std::vector<int>::const_iterator j = stack.begin(); j != stack.end(); j++)
-	  fprintf(stderr, " %d", *j);
-	fprintf(stderr, "\n");
-#endif
-      } while(!stack.empty());
+      }
+      std::sort(circuits.begin(), circuits.end());
     }
   }
 }
@@ -695,65 +1654,101 @@ static double dist_min(double v1, double v2)
     return v1;
 }
 
-double build_transistors_compute_force_dir(const set<int> &src, const set<int> &dst, int gate, const circuit_info &gci, const circuit_map &cmap, int &middle_x, int &middle_y)
+// Scratch space shared by the force computations of a die.  role
+// flags the circuits of the source (1) and destination (2) terminals.
+struct force_scratch {
+  std::vector<double> grid;
+  std::vector<unsigned char> role;
+  std::vector<pair<int, int> > dests;
+  std::vector<int> gates;
+  std::vector<pair<double, int> > buckets[3];
+
+  force_scratch(int nc) { role.resize(nc); }
+};
+
+// Distances from the source terminal through the gate are computed
+// with a bucketed Dijkstra over the 8-neighbours (1 and sqrt(2)
+// steps), which gives the values a relaxation to a fixed point would
+double build_transistors_compute_force_dir(const set<int> &src, const set<int> &dst, int gate, const circuit_info &gci, const circuit_map &cmap, int &middle_x, int &middle_y, force_scratch &fs)
 {
   int sx = gci.x1-gci.x0+1 + 4;
   int sy = gci.y1-gci.y0+1 + 4;
-  double *grid = new double[sx*sy];
-  std::vector<pair<int, int> > dests;
+  fs.grid.resize(sx*sy);
+  double *grid = fs.grid.data();
+  std::vector<pair<int, int> > &dests = fs.dests;
+  dests.clear();
+  fs.gates.clear();
+  for(set<int>::const_iterator i = src.begin(); i != src.end(); i++)
+    fs.role[*i] = 1;
+  for(set<int>::const_iterator i = dst.begin(); i != dst.end(); i++)
+    fs.role[*i] = 2;
+
   int x0 = gci.x0 - 2;
   int y0 = gci.y0 - 2;
   double *g = grid;
   for(int y=0; y<sy; y++)
     for(int x=0; x<sx; x++) {
       int cet = cmap.p(0, x+x0, y+y0);
+      int role = cet == -1 ? 0 : fs.role[cet];
       double v = -100000;
-      if(cet == gate)
+      if(cet == gate) {
 	v = 100000;
-      else if(src.find(cet) != src.end())
+	fs.gates.push_back(y*sx+x);
+      } else if(role == 1)
 	v = 0;
       *g++ = v;
-      if(x != 0 && x != sx-1 && y != 0 && y != sy-1 && dst.find(cet) != dst.end())
+      if(x != 0 && x != sx-1 && y != 0 && y != sy-1 && role == 2)
 	dests.push_back(pair<int, int>(x, y));
     }
 
-  int minx=1, miny=1, maxx=sx-2, maxy=sy-2;
-  while(minx<=maxx) {
-    int minx1 = minx;
-    int miny1 = miny;
-    int maxx1 = maxx;
-    int maxy1 = maxy;
-    minx = sx;
-    miny = sy;
-    maxx = -1;
-    maxy = -1;
-    for(int y=miny1; y<=maxy1; y++)
-      for(int x=minx1; x<=maxx1; x++) {
-	g = grid + y*sx + x;
-	if(*g <= 0)
-	  continue;
-	double v = -100000;
-	v = dist_min(v, g[-1-sx] + M_SQRT2);
-	v = dist_min(v, g[  -sx] + 1);
-	v = dist_min(v, g[ 1-sx] + M_SQRT2);
-	v = dist_min(v, g[-1   ] + 1);
-	v = dist_min(v, g[ 1   ] + 1);
-	v = dist_min(v, g[-1+sx] + M_SQRT2);
-	v = dist_min(v, g[   sx] + 1);
-	v = dist_min(v, g[ 1+sx] + M_SQRT2);
-	if(v < *g) {
-	  *g = v;
-	  if(x-1 < minx)
-	    minx = x-1;
-	  if(x+1 > maxx)
-	    maxx = x+1;
-	  if(y-1 < miny)
-	    miny = y-1;
-	  if(y+1 > maxy)
-	    maxy = y+1;
+  for(set<int>::const_iterator i = src.begin(); i != src.end(); i++)
+    fs.role[*i] = 0;
+  for(set<int>::const_iterator i = dst.begin(); i != dst.end(); i++)
+    fs.role[*i] = 0;
+
+  static const double step[8] = { M_SQRT2, 1, M_SQRT2, 1, 1, M_SQRT2, 1, M_SQRT2 };
+  const int delta[8] = { -1-sx, -sx, 1-sx, -1, 1, -1+sx, sx, 1+sx };
+  // Start from the gate pixels touching the source.  Steps are at
+  // least 1, so the pixels at a distance in [k, k+1) are final once
+  // all the ones below k have been handled, and the steps from them
+  // land in [k+1, k+3).  Three rotating buckets are enough.
+  for(int i=0; i != 3; i++)
+    fs.buckets[i].clear();
+  int pending = 0;
+  for(unsigned int i=0; i != fs.gates.size(); i++) {
+    int pos = fs.gates[i];
+    double d = 100000;
+    for(int j=0; j != 8; j++)
+      if(grid[pos + delta[j]] == 0 && step[j] < d)
+	d = step[j];
+    if(d < 100000) {
+      grid[pos] = d;
+      fs.buckets[1].push_back(pair<double, int>(d, pos));
+      pending++;
+    }
+  }
+
+  for(int k = 1; pending; k++) {
+    std::vector<pair<double, int> > &b = fs.buckets[k % 3];
+    for(unsigned int i=0; i != b.size(); i++) {
+      double d = b[i].first;
+      int pos = b[i].second;
+      if(d > grid[pos])
+	continue;
+      for(int j=0; j != 8; j++) {
+	int np = pos + delta[j];
+	double nd = d + step[j];
+	if(grid[np] > 0 && nd < grid[np]) {
+	  grid[np] = nd;
+	  fs.buckets[int(nd) % 3].push_back(pair<double, int>(nd, np));
+	  pending++;
 	}
       }
+    }
+    pending -= b.size();
+    b.clear();
   }
+
   double f = 0;
   double midx = 0, midy = 0;
   for(std::vector<pair<int, int> >::const_iterator i = dests.begin(); i != dests.end(); i++) {
@@ -776,125 +1771,244 @@ double build_transistors_compute_force_dir(const set<int> &src, const set<int> &
   }
   middle_x = x0 + int(midx / f + 0.5);
   middle_y = y0 + int(midy / f + 0.5);
-  delete[] grid;
   return f;
 }
 
-double build_transistors_compute_force(const set<int> &t1, const set<int> &t2, int gate, const circuit_info &gci, const circuit_map &cmap, int &middle_x, int &middle_y)
+double build_transistors_compute_force(const set<int> &t1, const set<int> &t2, int gate, const circuit_info &gci, const circuit_map &cmap, int &middle_x, int &middle_y, force_scratch &fs)
 {
   double f1, f2;
   int x1, x2, y1, y2;
-  f1 = build_transistors_compute_force_dir(t1, t2, gate, gci, cmap, x1, y1);
-  f2 = build_transistors_compute_force_dir(t2, t1, gate, gci, cmap, x2, y2);
+  f1 = build_transistors_compute_force_dir(t1, t2, gate, gci, cmap, x1, y1, fs);
+  f2 = build_transistors_compute_force_dir(t2, t1, gate, gci, cmap, x2, y2, fs);
   middle_x = (x1+x2)/2;
   middle_y = (y1+y2)/2;
 
   return 0.5*(f1 + f2);
 }
 
-void build_transistors(time_info &tinfo, std::vector<trans_info> &trans_infos, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap)
+// The gate of the previous run when its transistors still hold: same
+// bounding box, the same terminal groups up to the ids, and nothing
+// but ids changed in the part of the map the forces read
+static const gate_state *previous_gate(const gate_state &gs)
 {
-  for(unsigned int i=0; i != circuit_infos.size(); i++) {
-    tinfo.tick(i, circuit_infos.size());
-    if(circuit_infos[i].type == TRANSISTOR) {
-      std::vector<set<int> > groups;
-      std::vector<bool> is_gate, is_terminal;
-      int terminaux, gates;
-      build_transistor_groups(groups, terminaux, gates, is_terminal, is_gate, circuit_infos, i);
-
-      int ng = groups.size();
-      double *forces = new double[ng*ng];
-      int *midx = new int[ng*ng];
-      int *midy = new int[ng*ng];
-      int j=0;
-      for(std::vector<set<int> >::const_iterator ji = groups.begin(); ji != groups.end(); ji++, j++) {
-	if(!is_terminal[j])
+  if(!previous)
+    return NULL;
+  const previous_run &pr = *previous;
+  int o = pr.inv[gs.id];
+  if(o == -1 || o >= int(pr.gate_index.size()) || pr.gate_index[o] == -1)
+    return NULL;
+  const gate_state &og = pr.st.gates[pr.gate_index[o]];
+  if(og.x0 != gs.x0 || og.y0 != gs.y0 || og.x1 != gs.x1 || og.y1 != gs.y1 || og.groups.size() != gs.groups.size())
+    return NULL;
+  if(!pr.clean(gs.x0-2, gs.y0-2, gs.x1+2, gs.y1+2))
+    return NULL;
+  for(unsigned int i=0; i != gs.groups.size();) {
+    if(og.groups[i] != gs.groups[i])
+      return NULL;
+    unsigned int e = i + 1 + (gs.groups[i] >> 1);
+    for(i++; i != e; i++)
+      if(pr.inv[gs.groups[i]] != og.groups[i])
+	return NULL;
+  }
+  return &og;
+}
+
+static void build_transistors_one(std::vector<trans_info> &trans_infos, gate_state &gs, int i, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap, force_scratch &fs)
+{
+  std::vector<set<int> > groups;
+  std::vector<bool> is_gate, is_terminal;
+  int terminaux, gates;
+  build_transistor_groups(groups, terminaux, gates, is_terminal, is_gate, circuit_infos, i);
+
+  int ng = groups.size();
+  for(int j=0; j<ng; j++) {
+    gs.groups.push_back(groups[j].size()*2 + is_terminal[j]);
+    gs.groups.insert(gs.groups.end(), groups[j].begin(), groups[j].end());
+  }
+
+  const gate_state *og = previous_gate(gs);
+  if(og)
+    gs.trans = og->trans;
+  else {
+    double *forces = new double[ng*ng];
+    int *midx = new int[ng*ng];
+    int *midy = new int[ng*ng];
+    int j=0;
+    for(std::vector<set<int> >::const_iterator ji = groups.begin(); ji != groups.end(); ji++, j++) {
+      if(!is_terminal[j])
+	continue;
+      int k = j+1;
+      std::vector<set<int> >::const_iterator ki = ji;
+      ki++;
+      for(;ki != groups.end();ki++, k++) {
+	if(!is_terminal[k])
 	  continue;
-	int k = j+1;
-	std::vector<set<int> >::const_iterator ki = ji;
-	ki++;
-	for(;ki != groups.end();ki++, k++) {
-	  if(!is_terminal[k])
-	    continue;
-	  int idx = j*ng+k;
-	  forces[idx] = build_transistors_compute_force(*ji, *ki, i, circuit_infos[i], cmap, midx[idx], midy[idx]);
-	}
+	int idx = j*ng+k;
+	forces[idx] = build_transistors_compute_force(*ji, *ki, i, circuit_infos[i], cmap, midx[idx], midy[idx], fs);
       }
+    }
 
-      std::vector<int> nets;
-      std::vector<bool> linked;
-      linked.resize(ng);
-      for(j=0; j<ng; j++)
-	linked[j] = false;
-
-      for(std::vector<set<int> >::const_iterator ji = groups.begin(); ji != groups.end(); ji++)
-	nets.push_back(circuit_infos[*ji->begin()].net);
+    std::vector<bool> linked;
+    linked.resize(ng);
+    for(j=0; j<ng; j++)
+      linked[j] = false;
 
-      for(j=0; j<ng; j++) {
-	if(linked[j] || !is_terminal[j])
+    for(j=0; j<ng; j++) {
+      if(linked[j] || !is_terminal[j])
+	continue;
+      int best_k = -1;
+      double best_f = 0;
+      int best_idx = 0;
+      for(int k=0; k<ng; k++) {
+	if(j == k || !is_terminal[k])
 	  continue;
-	int best_k = -1;
-	double best_f = 0;
-	int best_idx = 0;
-	for(int k=0; k<ng; k++) {
-	  if(j == k || !is_terminal[k])
-	    continue;
-	  int idx = j < k ? j*ng+k : k*ng+j;
-	  double f = forces[idx];
-	  if(best_k == -1 || f > best_f) {
-	    best_k = k;
-	    best_f = f;
-	    best_idx = idx;
-	  }
+	int idx = j < k ? j*ng+k : k*ng+j;
+	double f = forces[idx];
+	if(best_k == -1 || f > best_f) {
+	  best_k = k;
+	  best_f = f;
+	  best_idx = idx;
 	}
-	linked[j] = true;
-	linked[best_k] = true;
-	trans_info ti;
-	ti.circ = i;
-	ti.t1 = nets[j];
-	ti.t2 = nets[best_k];
-	ti.gate = circuit_infos[i].net;
-	ti.strength = best_f;
-	ti.x = midx[best_idx];
-	ti.y = midy[best_idx];
-	trans_infos.push_back(ti);
       }
-      delete[] forces;
-      delete[] midx;
-      delete[] midy;
+      linked[j] = true;
+      linked[best_k] = true;
+      gate_trans gt;
+      gt.j = j;
+      gt.k = best_k;
+      gt.x = midx[best_idx];
+      gt.y = midy[best_idx];
+      gt.strength = best_f;
+      gs.trans.push_back(gt);
     }
+    delete[] forces;
+    delete[] midx;
+    delete[] midy;
   }
-}
 
+  std::vector<int> nets;
+  for(std::vector<set<int> >::const_iterator ji = groups.begin(); ji != groups.end(); ji++)
+    nets.push_back(circuit_infos[*ji->begin()].net);
+
+  for(const gate_trans &gt : gs.trans) {
+    trans_info ti;
+    ti.circ = i;
+    ti.t1 = nets[gt.j];
+    ti.t2 = nets[gt.k];
+    ti.gate = circuit_infos[i].net;
+    ti.strength = gt.strength;
+    ti.x = gt.x;
+    ti.y = gt.y;
+    trans_infos.push_back(ti);
+  }
+}
 
-void build_transistors_metal_gate(time_info &tinfo, std::vector<trans_info> &trans_infos, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap)
+static void build_transistors_metal_gate_one(std::vector<trans_info> &trans_infos, gate_state &gs, int i, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap, force_scratch &fs)
 {
-  for(unsigned int i=0; i != circuit_infos.size(); i++) {
-    tinfo.tick(i, circuit_infos.size());
-    if(circuit_infos[i].type == TRANSISTOR) {
-      const circuit_info &ci = circuit_infos[i];
-      if(ci.neighbors.size() != 2) {
-	fprintf(stderr, "Gate at (%d, %d)-(%d, %d) has %d neighbors.\n",
-		ci.x0, ci.y0, ci.x1, ci.y1,
-		int(ci.neighbors.size()));
-	continue;
-      }
+  const circuit_info &ci = circuit_infos[i];
+  if(ci.neighbors.size() != 2 || ci.net == -1)
+    return;
 
+  int n1 = ci.neighbors[0];
+  int n2 = ci.neighbors[1];
+  gs.groups = { 3, n1, 3, n2 };
+
+  const gate_state *og = previous_gate(gs);
+  if(og)
+    gs.trans = og->trans;
+  else {
+    set<int> t1, t2;
+    t1.insert(n1);
+    t2.insert(n2);
+    gate_trans gt;
+    gt.j = 0;
+    gt.k = 1;
+    gt.strength = build_transistors_compute_force(t1, t2, i, ci, cmap, gt.x, gt.y, fs);
+    gs.trans.push_back(gt);
+  }
 
-      trans_info ti;
-      ti.circ = i;
+  for(const gate_trans &gt : gs.trans) {
+    trans_info ti;
+    ti.circ = i;
+    ti.t1 = circuit_infos[n1].net;
+    ti.t2 = circuit_infos[n2].net;
+    ti.gate = ci.net;
+    ti.strength = gt.strength;
+    ti.x = gt.x;
+    ti.y = gt.y;
+    trans_infos.push_back(ti);
+  }
+}
 
-      set<int>::const_iterator ni = ci.neighbors.begin();
-      set<int> t1, t2;
-      t1.insert(*ni);
-      ti.t1 = circuit_infos[*ni++].net;
-      t2.insert(*ni);
-      ti.t2 = circuit_infos[*ni++].net;
-      ti.gate = ci.net;
-      ti.strength = build_transistors_compute_force(t1, t2, i, ci, cmap, ti.x, ti.y);
-      trans_infos.push_back(ti);
+// The gates are independent, so they are spread over the threads, each
+// with its own scratch space, and the results appended in circuit order.
+// With a map window, the gates are handled by groups starting in the
+// same window of rows.  They are in order of first pixel and read the
+// map from 2 rows above it, so the rows before the next group can be
+// dropped.  states gets the gates for the next run.
+static void build_transistors_parallel(time_info &tinfo, std::vector<trans_info> &trans_infos, std::vector<gate_state> &states, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap, bool metal_gate)
+{
+  std::vector<int> gates;
+  for(unsigned int i=0; i != circuit_infos.size(); i++)
+    if(circuit_infos[i].type == TRANSISTOR)
+      gates.push_back(i);
+
+  std::vector<std::vector<trans_info> > results(gates.size());
+  states.resize(gates.size());
+  std::vector<force_scratch *> scratch(row_bands(gates.size()));
+  int rows = cmap.window_rows();
+  map_sweep sw(cmap, 0);
+  unsigned int g0 = 0;
+  while(g0 != gates.size()) {
+    unsigned int g1 = gates.size();
+    if(rows) {
+      int ye = circuit_infos[gates[g0]].y0 + rows;
+      for(g1 = g0; g1 != gates.size() && circuit_infos[gates[g1]].y0 < ye; g1++);
     }
+    parallel_items(g1 - g0, 16, [&](int k, int thread) {
+	int j = g0 + k;
+	if(!thread && j+1 != int(gates.size()))
+	  tinfo.tick(j, gates.size());
+	if(!scratch[thread])
+	  scratch[thread] = new force_scratch(circuit_infos.size());
+	const circuit_info &ci = circuit_infos[gates[j]];
+	gate_state &gs = states[j];
+	gs.id = gates[j];
+	gs.x0 = ci.x0;
+	gs.y0 = ci.y0;
+	gs.x1 = ci.x1;
+	gs.y1 = ci.y1;
+	if(metal_gate)
+	  build_transistors_metal_gate_one(results[j], gs, gates[j], circuit_infos, cmap, *scratch[thread]);
+	else
+	  build_transistors_one(results[j], gs, gates[j], circuit_infos, cmap, *scratch[thread]);
+      });
+    if(g1 != gates.size())
+      sw.done(circuit_infos[gates[g1]].y0 - 2);
+    g0 = g1;
   }
+  for(force_scratch *fs : scratch)
+    delete fs;
+  if(!gates.empty())
+    tinfo.tick(gates.size()-1, gates.size());
+
+  for(unsigned int j=0; j != gates.size(); j++) {
+    const circuit_info &ci = circuit_infos[gates[j]];
+    if(metal_gate && ci.neighbors.size() != 2)
+      fprintf(stderr, "Gate at (%d, %d)-(%d, %d) has %d neighbors.\n",
+	      ci.x0+roi.x, ci.y0+roi.y, ci.x1+roi.x, ci.y1+roi.y,
+	      int(ci.neighbors.size()));
+    trans_infos.insert(trans_infos.end(), results[j].begin(), results[j].end());
+  }
+}
+
+void build_transistors(time_info &tinfo, std::vector<trans_info> &trans_infos, std::vector<gate_state> &states, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap)
+{
+  build_transistors_parallel(tinfo, trans_infos, states, circuit_infos, cmap, false);
+}
+
+void build_transistors_metal_gate(time_info &tinfo, std::vector<trans_info> &trans_infos, std::vector<gate_state> &states, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos, const circuit_map &cmap)
+{
+  build_transistors_parallel(tinfo, trans_infos, states, circuit_infos, cmap, true);
 }
 
 void circuit_stats(const std::vector<circuit_info> &circuit_infos)
@@ -915,7 +2029,7 @@ void dump(FILE *out, int sx, int sy, int nl, const std::vector<circuit_info> &ci
   for(unsigned int i=0; i != circuit_infos.size(); i++) {
     const circuit_info &ci = circuit_infos[i];
     fprintf(out, "%6d %c %5d %5d %5d %5d %5d %5d %d", i, type_names[ci.type], ci.net, ci.netp, ci.x0, sy-1-ci.y1, ci.x1, sy-1-ci.y0, ci.surface);
-    for(set<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
+    for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
       fprintf(out, " %c%d", type_names[circuit_infos[*j].type], *j);
     fprintf(out, "\n");
   }
@@ -927,7 +2041,7 @@ void dump(FILE *out, int sx, int sy, int nl, const std::vector<net_info> &net_in
   for(unsigned int i=0; i != net_infos.size(); i++) {
     const net_info &ni = net_infos[i];
     fprintf(out, "%5d", i);
-    for(set<int>::const_iterator j = ni.circuits.begin(); j != ni.circuits.end(); j++)
+    for(std::vector<int>::const_iterator j = ni.circuits.begin(); j != ni.circuits.end(); j++)
       fprintf(out, " %d", *j);
     fprintf(out, "\n");
   }
@@ -942,6 +2056,107 @@ void dump(FILE *out, int sx, int sy, int nl, const std::vector<trans_info> &tran
   }
 }
 
+static void dump_db_section(FILE *out, circuit_db_header &h, uint64_t &pos, int section, const void *data, uint64_t count, int esize)
+{
+  static const char zero[8] = { 0 };
+  int pad = (8 - (pos & 7)) & 7;
+  fwrite(zero, 1, pad, out);
+  pos += pad;
+  h.sections[section].offset = pos;
+  h.sections[section].count = count;
+  fwrite(data, esize, count, out);
+  pos += count*esize;
+}
+
+// Binary twin of the text dump, mapped directly by libdie's circuit_info
+void dump_db(const char *fname, int sx, int sy, int nl, const std::vector<trans_info> &trans_infos, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos)
+{
+  std::vector<cinfo> circs;
+  std::vector<tinfo> trans;
+  std::vector<int> neighbors_index, neighbors, net_circs_index, net_circs;
+
+  circs.resize(circuit_infos.size());
+  memset(&circs[0], 0, circs.size()*sizeof(cinfo));
+  for(unsigned int i=0; i != circuit_infos.size(); i++) {
+    const circuit_info &ci = circuit_infos[i];
+    cinfo &c = circs[i];
+    c.type = type_names[ci.type];
+    c.net = ci.net;
+    c.netp = ci.netp;
+    c.trans = -1;
+    c.x0 = ci.x0;
+    c.y0 = sy-1-ci.y1;
+    c.x1 = ci.x1;
+    c.y1 = sy-1-ci.y0;
+    c.surface = ci.surface;
+    neighbors_index.push_back(neighbors.size());
+    for(std::vector<int>::const_iterator j = ci.neighbors.begin(); j != ci.neighbors.end(); j++)
+      neighbors.push_back(*j);
+  }
+  neighbors_index.push_back(neighbors.size());
+
+  for(unsigned int i=0; i != net_infos.size(); i++) {
+    net_circs_index.push_back(net_circs.size());
+    for(std::vector<int>::const_iterator j = net_infos[i].circuits.begin(); j != net_infos[i].circuits.end(); j++)
+      net_circs.push_back(*j);
+  }
+  net_circs_index.push_back(net_circs.size());
+
+  trans.resize(trans_infos.size());
+  for(unsigned int i=0; i != trans_infos.size(); i++) {
+    const trans_info &ti = trans_infos[i];
+    tinfo &t = trans[i];
+    t.circ = ti.circ;
+    t.x = ti.x;
+    t.y = sy-1 - ti.y;
+    t.t1 = ti.t1;
+    t.gate = ti.gate;
+    t.t2 = ti.t2;
+    // Round the strength as the text dump does, so that both give
+    // the same simulation
+    char buf[64];
+    sprintf(buf, "%g", ti.strength);
+    t.f = strtod(buf, 0);
+    circs[ti.circ].trans = i;
+  }
+
+  circuit_db_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, cdb_magic, 8);
+  h.version = CDB_VERSION;
+  h.endian = CDB_ENDIAN;
+  h.sx = sx;
+  h.sy = sy;
+  h.nl = nl;
+  h.ncircs = circs.size();
+  h.nnets = net_infos.size();
+  h.ntrans = trans.size();
+
+  FILE *out = fopen(fname, "wb");
+  if(!out) {
+    perror(fname);
+    exit(1);
+  }
+  fwrite(&h, sizeof(h), 1, out);
+  uint64_t pos = sizeof(h);
+  dump_db_section(out, h, pos, CDB_CIRCS, circs.data(), circs.size(), sizeof(cinfo));
+  dump_db_section(out, h, pos, CDB_NEIGHBORS_INDEX, neighbors_index.data(), neighbors_index.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_NEIGHBORS, neighbors.data(), neighbors.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_NET_CIRCS_INDEX, net_circs_index.data(), net_circs_index.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_NET_CIRCS, net_circs.data(), net_circs.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_TRANS, trans.data(), trans.size(), sizeof(tinfo));
+
+  std::vector<int> gate_index, gate_list, term_index, term_list;
+  cdb_build_trans_index(trans.data(), trans.size(), net_infos.size(), gate_index, gate_list, term_index, term_list);
+  dump_db_section(out, h, pos, CDB_GATE_TRANS_INDEX, gate_index.data(), gate_index.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_GATE_TRANS, gate_list.data(), gate_list.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_TERM_TRANS_INDEX, term_index.data(), term_index.size(), sizeof(int));
+  dump_db_section(out, h, pos, CDB_TERM_TRANS, term_list.data(), term_list.size(), sizeof(int));
+  fseek(out, 0, SEEK_SET);
+  fwrite(&h, sizeof(h), 1, out);
+  fclose(out);
+}
+
 void dump(const char *fname, int sx, int sy, int nl, const std::vector<trans_info> &trans_infos, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos)
 {
   FILE *out = fopen(fname, "w");
@@ -949,6 +2164,7 @@ void dump(const char *fname, int sx, int sy, int nl, const std::vector<trans_inf
   dump(out, sx, sy, nl, net_infos);
   dump(out, sx, sy, nl, trans_infos);
   fclose(out);
+  dump_db((string(fname) + ".db").c_str(), sx, sy, nl, trans_infos, net_infos, circuit_infos);
 }
 
 // Add a virtual circuit between the two vcc domains
@@ -968,49 +2184,47 @@ void add_virtual_circuit(std::vector<circuit_info> &circuit_infos, metal_link_in
 }
 
 // Add a pair of virtual vias with the virtual circuit
-void add_virtual_vias(std::vector<via_info> &via_infos, via_map &via_maps, metal_link_info &ml, const circuit_map &cmap)
+void add_virtual_vias(std::vector<via_info> &via_infos, metal_link_info &ml, const circuit_map &cmap)
 {
   int vcc1 = cmap.p(cmap.nl >= 3 ? 2 : 1, ml.x1, cmap.sy-1-ml.y1);
   int vcc2 = cmap.p(cmap.nl >= 3 ? 2 : 1, ml.x2, cmap.sy-1-ml.y2);
   via_infos.push_back(via_info(vcc1, ml.circuit_id));
   via_infos.push_back(via_info(vcc2, ml.circuit_id));
-  via_maps.metal_to_ap[vcc1].push_back(ml.circuit_id);
-  via_maps.metal_to_ap[vcc2].push_back(ml.circuit_id);
-  via_maps.ap_to_metal[ml.circuit_id].push_back(vcc1);
-  via_maps.ap_to_metal[ml.circuit_id].push_back(vcc2);
 }
 
 // In a metal gates circuit, lookup the metal net corresponding to gates and caps
-void lookup_gates_and_caps(time_info &tinfo, std::vector<circuit_info> &circuit_infos, const circuit_map &cmap)
+//
+// The bands list the first pixel where each gate or cap label sees
+// each metal label, or no metal.  Replaying the lists in band order
+// finds the same conflicts at the same pixels as a scan of the map.
+void lookup_gates_and_caps(time_info &tinfo, std::vector<circuit_info> &circuit_infos, const std::vector<cc_band> &gbands, const std::vector<cc_band> &mbands, const std::vector<int> *cids)
 {
-  for(int y=0; y<cmap.sy; y++) {
-    tinfo.tick(y, cmap.sy);
-    for(int x=0; x<cmap.sx; x++) {
-      int ca = cmap.p(0, x, y);
-      if(ca == -1)
-	continue;
-      circuit_info &ci = circuit_infos[ca];
-      if(ci.type == TRANSISTOR || ci.type == CAPACITOR) {
-	int cm = cmap.p(1, x, y);
-	if(cm == -1) {
-	  fprintf(stderr, "%s does not touch metal at (%d, %d)\n", ci.type == TRANSISTOR ? "Gate" : "Capacitor", x, y);
+  for(unsigned int b=0; b != gbands.size(); b++) {
+    tinfo.tick(b, gbands.size());
+    for(const gate_touch &gt : gbands[b].touches) {
+      circuit_info &ci = circuit_infos[cids[0][gbands[b].offset + gt.circ]];
+      int x = gt.x, y = gt.y;
+      if(gt.metal == -1) {
+	// The metal may be outside of the crop
+	if(roi.border(ci))
+	  continue;
+	fprintf(stderr, "%s does not touch metal at (%d, %d)\n", ci.type == TRANSISTOR ? "Gate" : "Capacitor", x+roi.x, y+roi.y);
+	exit(1);
+      }
+      int nm = circuit_infos[cids[1][mbands[b].offset + gt.metal]].net;
+      if(ci.type == TRANSISTOR) {
+	if(ci.net == -1)
+	  ci.net = nm;
+	else if(ci.net != nm) {
+	  fprintf(stderr, "Transistor touches multiple metal at (%d, %d)\n", x+roi.x, y+roi.y);
 	  exit(1);
 	}
-	int nm = circuit_infos[cm].net;
-	if(ci.type == TRANSISTOR) {
-	  if(ci.net == -1)
-	    ci.net = nm;
-	  else if(ci.net != nm) {
-	    fprintf(stderr, "Transistor touches multiple metal at (%d, %d)\n", x, y);
-	    exit(1);
-	  }
-	} else {
-	  if(ci.netp == -1)
-	    ci.netp = nm;
-	  else if(ci.netp != nm) {
-	    fprintf(stderr, "Capacitor touches multiple metal at (%d, %d)\n", x, y);
-	    exit(1);
-	  }
+      } else {
+	if(ci.netp == -1)
+	  ci.netp = nm;
+	else if(ci.netp != nm) {
+	  fprintf(stderr, "Capacitor touches multiple metal at (%d, %d)\n", x+roi.x, y+roi.y);
+	  exit(1);
 	}
       }
     }
@@ -1018,97 +2232,591 @@ void lookup_gates_and_caps(time_info &tinfo, std::vector<circuit_info> &circuit_
 }
 
 
-pbm *active = NULL;
-pbm *gates = NULL;
-pbm *buried = NULL;
-pbm *metal = NULL;
-pbm *poly = NULL;
-pbm *vias = NULL;
-pbm *caps = NULL;
 std::vector<metal_link_info> metal_links;
 
 const char *map_name = NULL;
 const char *list_name = NULL;
+const char *profile_name = NULL;
 int sx;
 int sy;
 
-void nmos_poly_single_metal()
+pbm *roi_crop(pbm *img, int cx0, int cy0, int cx1, int cy1)
+{
+  if(!img)
+    return NULL;
+  pbm *crop = new pbm(roi.sx, roi.sy);
+  for(int y=0; y != roi.sy; y++)
+    for(int x=0; x != roi.sx; x++)
+      if(x+roi.x >= cx0 && x+roi.x <= cx1 && y+roi.y >= cy0 && y+roi.y <= cy1 && x+roi.x < img->sx && y+roi.y < img->sy && img->p(x+roi.x, y+roi.y))
+	crop->s(x, y, true);
+  delete img;
+  return crop;
+}
+
+// Restrict the extraction to (x0, y0)-(x1, y1) plus a margin, in
+// bottom-up coordinates like metal-link
+void roi_apply(int x0, int y0, int x1, int y1, int margin)
+{
+  int cx0 = max(0, min(x0, x1) - margin);
+  int cx1 = min(sx-1, max(x0, x1) + margin);
+  int cy0 = max(0, sy-1 - max(y0, y1) - margin);
+  int cy1 = min(sy-1, sy-1 - min(y0, y1) + margin);
+  if(cx0 > cx1 || cy0 > cy1) {
+    fprintf(stderr, "Region of interest (%d, %d)-(%d, %d) is outside of the die\n", x0, y0, x1, y1);
+    exit(1);
+  }
+
+  roi.active = true;
+  roi.cut[0] = cx0 != 0;
+  roi.cut[1] = cy0 != 0;
+  roi.cut[2] = cx1 != sx-1;
+  roi.cut[3] = cy1 != sy-1;
+  roi.x = cx0 - (roi.cut[0] ? roi.PAD : 0);
+  roi.y = cy0 - (roi.cut[1] ? roi.PAD : 0);
+  roi.sx = cx1 + (roi.cut[2] ? roi.PAD : 0) - roi.x + 1;
+  roi.sy = cy1 + (roi.cut[3] ? roi.PAD : 0) - roi.y + 1;
+  roi.yb = sy - roi.y - roi.sy;
+
+  active = roi_crop(active, cx0, cy0, cx1, cy1);
+  gates = roi_crop(gates, cx0, cy0, cx1, cy1);
+  buried = roi_crop(buried, cx0, cy0, cx1, cy1);
+  metal = roi_crop(metal, cx0, cy0, cx1, cy1);
+  poly = roi_crop(poly, cx0, cy0, cx1, cy1);
+  vias = roi_crop(vias, cx0, cy0, cx1, cy1);
+  caps = roi_crop(caps, cx0, cy0, cx1, cy1);
+
+  std::vector<metal_link_info> links;
+  for(metal_link_info ml : metal_links) {
+    if(ml.x1 < cx0 || ml.x1 > cx1 || ml.x2 < cx0 || ml.x2 > cx1 || ml.y1 < cy0 || ml.y1 > cy1 || ml.y2 < cy0 || ml.y2 > cy1)
+      continue;
+    ml.x1 -= roi.x;
+    ml.x2 -= roi.x;
+    ml.y1 -= roi.y;
+    ml.y2 -= roi.y;
+    links.push_back(ml);
+  }
+  if(links.size() != metal_links.size())
+    fprintf(stderr, "%d metal links outside of the region of interest ignored\n", int(metal_links.size() - links.size()));
+  metal_links = links;
+
+  fprintf(stderr, "Extracting (%d, %d)-(%d, %d), crop origin at (%d, %d)\n", cx0, sy-1-cy1, cx1, sy-1-cy0, roi.x, roi.yb);
+  sx = roi.sx;
+  sy = roi.sy;
+}
+
+// Lists the origin of the crop in the die and the circuits and nets
+// cut by its border, which may be incomplete or wrongly connected
+void dump_roi(const char *fname, const std::vector<net_info> &net_infos, const std::vector<circuit_info> &circuit_infos)
+{
+  std::vector<int> border_circuits, border_nets;
+  for(unsigned int i=0; i != circuit_infos.size(); i++)
+    if(roi.border(circuit_infos[i]))
+      border_circuits.push_back(i);
+  for(unsigned int i=0; i != net_infos.size(); i++)
+    for(int c : net_infos[i].circuits)
+      if(roi.border(circuit_infos[c % cap_poly_offset])) {
+	border_nets.push_back(i);
+	break;
+      }
+
+  FILE *out = fopen(fname, "w");
+  if(!out) {
+    perror(fname);
+    exit(1);
+  }
+  fprintf(out, "%d %d\n", roi.x, roi.yb);
+  fprintf(out, "%d border circuits\n", int(border_circuits.size()));
+  for(int i : border_circuits)
+    fprintf(out, "%6d %c\n", i, type_names[circuit_infos[i].type]);
+  fprintf(out, "%d border nets\n", int(border_nets.size()));
+  for(int i : border_nets)
+    fprintf(out, "%5d\n", i);
+  fclose(out);
+  fprintf(stderr, "  -> %d circuits and %d nets on the region border\n", int(border_circuits.size()), int(border_nets.size()));
+}
+
+// Layer tile hashes of the last successful run, saved next to the map
+// as <map>.tiles.  When the configuration, the layers and the outputs
+// are the same on the next run there is nothing to extract.  Otherwise
+// the changed tiles are reported, their box is what a roi needs to
+// cover to check an edit.
+//
+// The labels of each band and what they became are kept in
+// <map>.labels.  When only some tiles changed, the bands they reach are
+// labeled again and merged with the other ones, and the transistors of
+// the gates where only ids changed are taken as they were.  Circuits,
+// nets and transistors are numbered in die order and the map holds the
+// numbers, so the outputs are still written whole, as a clean run
+// would write them.
+
+enum { TILE_SIZE = 256 };
+
+struct tile_layer {
+  string name;
+  int sx, sy;
+  std::vector<uint64_t> hashes;
+};
+
+struct tile_state {
+  uint64_t config;
+  int64_t map_size, list_size;
+  std::vector<tile_layer> layers;
+};
+
+static uint64_t fnv_hash(uint64_t h, const unsigned char *data, int64_t size)
+{
+  for(int64_t i=0; i != size; i++)
+    h = (h ^ data[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static int64_t file_size(string fname)
+{
+  struct stat st;
+  if(stat(fname.c_str(), &st))
+    return -1;
+  return st.st_size;
+}
+
+static void tiles_add_layer(tile_state &ts, const char *name, const pbm *img)
+{
+  if(!img)
+    return;
+  ts.layers.resize(ts.layers.size()+1);
+  tile_layer &tl = ts.layers.back();
+  tl.name = name;
+  tl.sx = img->sx;
+  tl.sy = img->sy;
+  int tx = (img->sx + TILE_SIZE - 1) / TILE_SIZE;
+  int ty = (img->sy + TILE_SIZE - 1) / TILE_SIZE;
+  tl.hashes.resize(tx*ty);
+  parallel_rows(ty, [&](int y0, int y1, int b) {
+      for(int y=y0; y != y1; y++) {
+	for(int x=0; x != tx; x++) {
+	  int xb0 = x*(TILE_SIZE/8);
+	  int xb1 = min(img->sxb, xb0 + TILE_SIZE/8);
+	  uint64_t h = 0xcbf29ce484222325ULL;
+	  for(int yy = y*TILE_SIZE; yy != min(img->sy, (y+1)*TILE_SIZE); yy++)
+	    h = fnv_hash(h, img->img + int64_t(yy)*img->sxb + xb0, xb1-xb0);
+	  tl.hashes[y*tx+x] = h;
+	}
+	if(chunk_memory)
+	  img->release_rows(y*TILE_SIZE, (y+1)*TILE_SIZE);
+      }
+    });
+}
+
+static void tiles_compute(tile_state &ts, const char *config)
+{
+  FILE *fd = fopen(config, "rb");
+  std::vector<unsigned char> text;
+  int c;
+  while((c = fgetc(fd)) != EOF)
+    text.push_back(c);
+  fclose(fd);
+  ts.config = fnv_hash(0xcbf29ce484222325ULL, text.data(), text.size());
+  ts.map_size = ts.list_size = -1;
+  tiles_add_layer(ts, "active", active);
+  tiles_add_layer(ts, "gates", gates);
+  tiles_add_layer(ts, "buried", buried);
+  tiles_add_layer(ts, "metal", metal);
+  tiles_add_layer(ts, "poly", poly);
+  tiles_add_layer(ts, "vias", vias);
+  tiles_add_layer(ts, "caps", caps);
+}
+
+static bool tiles_load(const char *fname, tile_state &ts)
+{
+  FILE *fd = fopen(fname, "rb");
+  if(!fd)
+    return false;
+  char name[64];
+  int nl;
+  bool ok = fscanf(fd, "%" SCNx64 " %" SCNd64 " %" SCNd64 " %d", &ts.config, &ts.map_size, &ts.list_size, &nl) == 4;
+  for(int i=0; ok && i != nl; i++) {
+    tile_layer tl;
+    unsigned int nt;
+    ok = fscanf(fd, "%63s %d %d %u", name, &tl.sx, &tl.sy, &nt) == 4;
+    tl.name = name;
+    tl.hashes.resize(nt);
+    for(unsigned int j=0; ok && j != nt; j++)
+      ok = fscanf(fd, "%" SCNx64, &tl.hashes[j]) == 1;
+    ts.layers.push_back(tl);
+  }
+  fclose(fd);
+  return ok;
+}
+
+static void tiles_save(const char *fname, const tile_state &ts)
+{
+  FILE *fd = fopen(fname, "w");
+  if(!fd) {
+    perror(fname);
+    return;
+  }
+  fprintf(fd, "%016" PRIx64 " %" PRId64 " %" PRId64 " %d\n", ts.config, ts.map_size, ts.list_size, int(ts.layers.size()));
+  for(const tile_layer &tl : ts.layers) {
+    fprintf(fd, "%s %d %d %d\n", tl.name.c_str(), tl.sx, tl.sy, int(tl.hashes.size()));
+    for(unsigned int j=0; j != tl.hashes.size(); j++)
+      fprintf(fd, "%016" PRIx64 "%c", tl.hashes[j], (j % 8) == 7 || j == tl.hashes.size()-1 ? '\n' : ' ');
+  }
+  fclose(fd);
+}
+
+// Returns true when the previous outputs are still valid.  Otherwise
+// prints the changed tiles and flags in dirty the labeling bands they
+// reach, dirty staying empty when all of them have to be labeled.
+static bool tiles_compare(const tile_state &old, const tile_state &cur, std::vector<char> &dirty)
+{
+  if(old.config != cur.config || old.layers.size() != cur.layers.size()) {
+    fprintf(stderr, "Configuration changed, full extraction\n");
+    return false;
+  }
+  if(old.map_size != file_size(map_name) || old.list_size != file_size(list_name) || file_size(string(list_name) + ".db") < 0) {
+    fprintf(stderr, "Outputs missing or changed, full extraction\n");
+    return false;
+  }
+
+  int dirty_tiles = 0, total = 0;
+  int x0 = sx, y0 = sy, x1 = -1, y1 = -1;
+  std::vector<char> bands((sy + LABEL_BAND - 1) / LABEL_BAND, 0);
+  for(unsigned int l=0; l != cur.layers.size(); l++) {
+    const tile_layer &ot = old.layers[l];
+    const tile_layer &ct = cur.layers[l];
+    if(ot.name != ct.name || ot.sx != ct.sx || ot.sy != ct.sy || ot.hashes.size() != ct.hashes.size()) {
+      fprintf(stderr, "Layer %s changed size, full extraction\n", ct.name.c_str());
+      return false;
+    }
+    int tx = (ct.sx + TILE_SIZE - 1) / TILE_SIZE;
+    for(unsigned int j=0; j != ct.hashes.size(); j++) {
+      total++;
+      if(ot.hashes[j] == ct.hashes[j])
+	continue;
+      dirty_tiles++;
+      int x = (j % tx) * TILE_SIZE;
+      int y = (j / tx) * TILE_SIZE;
+      x0 = min(x0, x);
+      y0 = min(y0, y);
+      x1 = max(x1, min(ct.sx, x + TILE_SIZE) - 1);
+      y1 = max(y1, min(ct.sy, y + TILE_SIZE) - 1);
+      // The colorers look 5 rows around a pixel
+      for(int b = max(0, (y - 5) / LABEL_BAND); b != int(bands.size()) && b*LABEL_BAND < y + TILE_SIZE + 5; b++)
+	bands[b] = 1;
+    }
+  }
+  if(!dirty_tiles)
+    return true;
+  fprintf(stderr, "%d of %d layer tiles changed in (%d, %d)-(%d, %d)\n", dirty_tiles, total, x0+roi.x, sy-1-y1+roi.yb, x1+roi.x, sy-1-y0+roi.yb);
+  dirty.swap(bands);
+  return false;
+}
+
+// The state follows the tiles in the labels file
+#define STATE_MAGIC "GCSTATE1"
+
+struct state_header {
+  char magic[8];
+  int32_t nl, sx, sy, band, nbands, nvirt;
+};
+
+template<typename T> static void state_write(FILE *fd, const std::vector<T> &v)
+{
+  uint64_t n = v.size();
+  fwrite(&n, 8, 1, fd);
+  fwrite(v.data(), sizeof(T), n, fd);
+}
+
+template<typename T> static bool state_read(const unsigned char *&p, const unsigned char *end, std::vector<T> &v)
+{
+  uint64_t n;
+  if(end - p < 8)
+    return false;
+  memcpy(&n, p, 8);
+  p += 8;
+  if(n > uint64_t(end - p) / sizeof(T))
+    return false;
+  v.resize(n);
+  if(n)
+    memcpy((void *)v.data(), p, n*sizeof(T));
+  p += n*sizeof(T);
+  return true;
+}
+
+static void state_save(const char *fname, const extract_state &st, int nl)
+{
+  FILE *fd = fopen(fname, "ab");
+  if(!fd) {
+    perror(fname);
+    exit(1);
+  }
+  state_header h;
+  memcpy(h.magic, STATE_MAGIC, 8);
+  h.nl = nl;
+  h.sx = sx;
+  h.sy = sy;
+  h.band = LABEL_BAND;
+  h.nbands = st.bands[0].size();
+  h.nvirt = st.nvirt;
+  fwrite(&h, sizeof(h), 1, fd);
+  for(int p=0; p != 2; p++)
+    for(const cc_band &band : st.bands[p]) {
+      state_write(fd, band.labels);
+      state_write(fd, band.first);
+      state_write(fd, band.last);
+      state_write(fd, band.pairs);
+      state_write(fd, band.touches);
+    }
+  state_write(fd, st.ids.own);
+  state_write(fd, st.ids.ta);
+  state_write(fd, st.ids.tp);
+  uint64_t ng = st.gates.size();
+  fwrite(&ng, 8, 1, fd);
+  for(const gate_state &gs : st.gates) {
+    int32_t g[5] = { gs.id, gs.x0, gs.y0, gs.x1, gs.y1 };
+    fwrite(g, 4, 5, fd);
+    state_write(fd, gs.groups);
+    state_write(fd, gs.trans);
+  }
+  bool err = ferror(fd);
+  if(fclose(fd) || err) {
+    perror(fname);
+    exit(1);
+  }
+}
+
+static bool state_load(const unsigned char *p, const unsigned char *end, extract_state &st, int nl)
+{
+  state_header h;
+  int nb = (sy + LABEL_BAND - 1) / LABEL_BAND;
+  if(end - p < int64_t(sizeof(h)))
+    return false;
+  memcpy(&h, p, sizeof(h));
+  p += sizeof(h);
+  if(memcmp(h.magic, STATE_MAGIC, 8) || h.nl != nl || h.sx != sx || h.sy != sy || h.band != LABEL_BAND || h.nbands != nb || h.nvirt != int(metal_links.size()))
+    return false;
+  st.nvirt = h.nvirt;
+  for(int p1=0; p1 != 2; p1++) {
+    st.bands[p1].resize(nb);
+    for(cc_band &band : st.bands[p1])
+      if(!state_read(p, end, band.labels) || !state_read(p, end, band.first) || !state_read(p, end, band.last) || !state_read(p, end, band.pairs) || !state_read(p, end, band.touches))
+	return false;
+  }
+  if(!state_read(p, end, st.ids.own) || !state_read(p, end, st.ids.ta) || !state_read(p, end, st.ids.tp))
+    return false;
+  uint64_t ng;
+  if(end - p < 8)
+    return false;
+  memcpy(&ng, p, 8);
+  p += 8;
+  if(ng > uint64_t(end - p) / 20)
+    return false;
+  st.gates.resize(ng);
+  for(gate_state &gs : st.gates) {
+    int32_t g[5];
+    if(end - p < 20)
+      return false;
+    memcpy(g, p, 20);
+    p += 20;
+    gs.id = g[0];
+    gs.x0 = g[1];
+    gs.y0 = g[2];
+    gs.x1 = g[3];
+    gs.y1 = g[4];
+    if(!state_read(p, end, gs.groups) || !state_read(p, end, gs.trans))
+      return false;
+  }
+  return p == end;
+}
+
+// The labels of the previous run for an incremental one, NULL when
+// they are missing or do not fit this run
+static previous_run *previous_load(const char *fname, std::vector<char> &dirty, int nl)
+{
+  previous_run *pr = new previous_run;
+  pr->dirty.swap(dirty);
+  pr->in_place = !tiled_map;
+  pr->sx = sx;
+  pr->sy = sy;
+  const unsigned char *p, *end;
+  bool ok = pr->labels.open(fname, 2, sx, sy);
+  if(ok) {
+    int64_t size;
+    p = pr->labels.trailer(size);
+    end = p + size;
+    ok = state_load(p, end, pr->st, nl);
+  }
+  if(ok && pr->in_place)
+    ok = file_size(map_name) == int64_t(nl)*4*sx*sy;
+
+  // The previous circuits of the labels, and their numbers must fit
+  // the tables
+  extract_state &st = pr->st;
+  if(ok) {
+    st.n0 = cc_merge(st.bands[0], 0, pr->cids[0], NULL);
+    int n = st.n0 + st.nvirt + cc_merge(st.bands[1], st.n0 + st.nvirt, pr->cids[1], NULL);
+    ok = int(st.ids.own.size()) == n && int(st.ids.ta.size()) == n && (st.ids.tp.empty() || int(st.ids.tp.size()) == n);
+  }
+  if(ok) {
+    for(int p1=0; p1 != 2; p1++) {
+      for(const cc_band &band : st.bands[p1])
+	pr->offsets[p1].push_back(band.offset);
+      pr->offsets[p1].push_back(pr->cids[p1].size());
+    }
+    int nfo = 0;
+    for(int id : st.ids.own)
+      nfo = max(nfo, id+1);
+    pr->gate_index.assign(nfo, -1);
+    for(unsigned int i=0; ok && i != st.gates.size(); i++) {
+      ok = st.gates[i].id >= 0 && st.gates[i].id < nfo;
+      if(ok)
+	pr->gate_index[st.gates[i].id] = i;
+    }
+  }
+  if(!ok) {
+    delete pr;
+    return NULL;
+  }
+  return pr;
+}
+
+void nmos_poly_single_metal(time_info &tinfo)
 {
   std::vector<circuit_info> circuit_infos;
   std::vector<via_info> via_infos;
   via_map via_maps;
   std::vector<net_info> net_infos;
   std::vector<trans_info> trans_infos;
+  extract_state st;
+  std::vector<int> cids[2];
+  string labels_name = string(map_name) + ".labels.tmp";
 
-  circuit_map cmap(map_name, 3, sx, sy, true);
+  tinfo.stage("creating map");
+  circuit_map cmap(map_name, 3, sx, sy, !previous || !previous->in_place);
 
-  time_info tinfo;
   tinfo.start("build circuits active/poly");
-  build_circuits(tinfo, boost::bind(color_active_poly, _1, _2, active, poly, buried, caps), circuit_infos, &cmap, 0);
+  label_bands(tinfo, active_poly_colorer(active, poly, buried, caps, min(chunk_rows(sx, sy), int(LABEL_BAND))), cmap, 0, 0, st.bands[0]);
+  st.n0 = cc_merge(st.bands[0], 0, cids[0], &circuit_infos);
+  st.nvirt = metal_links.size();
   for(std::vector<metal_link_info>::iterator i = metal_links.begin(); i != metal_links.end(); i++)
     add_virtual_circuit(circuit_infos, *i, sy, true);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
   tinfo.start("build circuits metal");
-  build_circuits(tinfo, boost::bind(color_metal, _1, _2, metal), circuit_infos, &cmap, 2);
+  label_bands(tinfo, boost::bind(color_metal, _1, _2, metal), cmap, 2, 1, st.bands[1]);
+  cc_merge(st.bands[1], circuit_infos.size(), cids[1], &circuit_infos);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
   tinfo.start("build neighbors");
-  build_neighbors(tinfo, circuit_infos, cmap);
+  build_neighbors(tinfo, circuit_infos, st.bands[0], cids[0], sx, sy);
   tinfo.start("clean and remap");
-  clean_and_remap(tinfo, circuit_infos, cmap);
+  std::vector<int> remap_active, remap_poly;
+  clean_and_remap(tinfo, circuit_infos, remap_active, remap_poly);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
   tinfo.start("compressing ids");
-  compress_ids(tinfo, circuit_infos, metal_links, cmap);
+  compress_ids(tinfo, circuit_infos, metal_links, remap_active, remap_poly, st.ids);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
+  tinfo.stage("writing map");
+  if(previous)
+    match_previous(st, cids, circuit_infos.size());
+  write_map(tinfo, cmap, st, cids, labels_name.c_str());
   tinfo.start("mapping vias");
-  map_vias(tinfo, via_infos, via_maps, circuit_infos, vias, cmap);
+  map_vias(tinfo, via_infos, circuit_infos, vias, cmap);
   for(std::vector<metal_link_info>::iterator i = metal_links.begin(); i != metal_links.end(); i++)
-    add_virtual_vias(via_infos, via_maps, *i, cmap);
+    add_virtual_vias(via_infos, *i, cmap);
+  build_via_map(via_maps, via_infos, circuit_infos.size());
   fprintf(stderr, "  -> %d vias mapped\n", int(via_infos.size()));
+  tinfo.count(via_infos.size());
   tinfo.start("building nets");
   build_nets(tinfo, net_infos, circuit_infos, via_maps, true, sx, sy);
   fprintf(stderr, "  -> %d nets built\n", int(net_infos.size()));
+  tinfo.count(net_infos.size());
   tinfo.start("building transistors");
-  build_transistors(tinfo, trans_infos, net_infos, circuit_infos, cmap);
+  build_transistors(tinfo, trans_infos, st.gates, net_infos, circuit_infos, cmap);
   fprintf(stderr, "  -> %d transistors built\n", int(trans_infos.size()));
+  tinfo.count(trans_infos.size());
   fprintf(stderr, "Dumping info...\n");
+  tinfo.stage("dumping info");
   dump(list_name, sx, sy, 3, trans_infos, net_infos, circuit_infos);
+  if(roi.active)
+    dump_roi((string(list_name) + ".roi").c_str(), net_infos, circuit_infos);
+  state_save(labels_name.c_str(), st, 3);
+  if(tiled_map) {
+    fprintf(stderr, "Writing tiled map...\n");
+    tinfo.stage("writing tiled map");
+    save_tiled_map(map_name, cmap);
+  }
 }
 
-void nmos_metal_gate()
+void nmos_metal_gate(time_info &tinfo)
 {
   std::vector<circuit_info> circuit_infos;
   std::vector<via_info> via_infos;
   via_map via_maps;
   std::vector<net_info> net_infos;
   std::vector<trans_info> trans_infos;
+  extract_state st;
+  std::vector<int> cids[2];
+  string labels_name = string(map_name) + ".labels.tmp";
 
-  circuit_map cmap(map_name, 2, sx, sy, true);
-  time_info tinfo;
+  tinfo.stage("creating map");
+  circuit_map cmap(map_name, 2, sx, sy, !previous || !previous->in_place);
   tinfo.start("build circuits active/gates");
-  build_circuits(tinfo, boost::bind(color_active_gates, _1, _2, active, gates, caps), circuit_infos, &cmap, 0);
+  label_bands(tinfo, boost::bind(color_active_gates, _1, _2, active, gates, caps), cmap, 0, 0, st.bands[0]);
+  st.n0 = cc_merge(st.bands[0], 0, cids[0], &circuit_infos);
+  st.nvirt = metal_links.size();
   for(std::vector<metal_link_info>::iterator i = metal_links.begin(); i != metal_links.end(); i++)
     add_virtual_circuit(circuit_infos, *i, sy, false);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
   tinfo.start("build circuits metal");
-  build_circuits(tinfo, boost::bind(color_metal, _1, _2, metal), circuit_infos, &cmap, 1);
+  label_bands(tinfo, boost::bind(color_metal, _1, _2, metal), cmap, 1, 1, st.bands[1]);
+  gate_touches(cmap, st.bands[0], st.bands[1]);
+  cc_merge(st.bands[1], circuit_infos.size(), cids[1], &circuit_infos);
   circuit_stats(circuit_infos);
+  tinfo.count(circuit_infos.size());
   tinfo.start("build neighbors");
-  build_neighbors(tinfo, circuit_infos, cmap);
+  build_neighbors(tinfo, circuit_infos, st.bands[0], cids[0], sx, sy);
+
+  // Nothing is disabled, the ids stay as they are
+  int nc = circuit_infos.size();
+  st.ids.own.resize(nc);
+  for(int i=0; i != nc; i++)
+    st.ids.own[i] = i;
+  st.ids.ta = st.ids.own;
+  tinfo.stage("writing map");
+  if(previous)
+    match_previous(st, cids, nc);
+  write_map(tinfo, cmap, st, cids, labels_name.c_str());
   tinfo.start("mapping vias");
-  map_vias(tinfo, via_infos, via_maps, circuit_infos, vias, cmap);
+  map_vias(tinfo, via_infos, circuit_infos, vias, cmap);
   for(std::vector<metal_link_info>::iterator i = metal_links.begin(); i != metal_links.end(); i++)
-    add_virtual_vias(via_infos, via_maps, *i, cmap);
+    add_virtual_vias(via_infos, *i, cmap);
+  build_via_map(via_maps, via_infos, circuit_infos.size());
   fprintf(stderr, "  -> %d vias mapped\n", int(via_infos.size()));
+  tinfo.count(via_infos.size());
   tinfo.start("building nets");
   build_nets(tinfo, net_infos, circuit_infos, via_maps, false, sx, sy);
   fprintf(stderr, "  -> %d nets built\n", int(net_infos.size()));
+  tinfo.count(net_infos.size());
   tinfo.start("lookup gates and caps");
-  lookup_gates_and_caps(tinfo, circuit_infos, cmap);
+  lookup_gates_and_caps(tinfo, circuit_infos, st.bands[0], st.bands[1], cids);
   tinfo.start("building transistors");
-  build_transistors_metal_gate(tinfo, trans_infos, net_infos, circuit_infos, cmap);
+  build_transistors_metal_gate(tinfo, trans_infos, st.gates, net_infos, circuit_infos, cmap);
   fprintf(stderr, "  -> %d transistors built\n", int(trans_infos.size()));
+  tinfo.count(trans_infos.size());
   fprintf(stderr, "Dumping info...\n");
+  tinfo.stage("dumping info");
   dump(list_name, sx, sy, 2, trans_infos, net_infos, circuit_infos);
+  if(roi.active)
+    dump_roi((string(list_name) + ".roi").c_str(), net_infos, circuit_infos);
+  state_save(labels_name.c_str(), st, 2);
+  if(tiled_map) {
+    fprintf(stderr, "Writing tiled map...\n");
+    tinfo.stage("writing tiled map");
+    save_tiled_map(map_name, cmap);
+  }
 }
 
 int main(int argc, char **argv)
@@ -1125,7 +2833,9 @@ int main(int argc, char **argv)
   sy = rd.gi();
   rd.nl();
 
-  void (*method)() = NULL;
+  void (*method)(time_info &) = NULL;
+  bool has_roi = false;
+  int roi_x0 = 0, roi_y0 = 0, roi_x1 = 0, roi_y1 = 0, roi_margin = 16;
 
   while(!rd.eof()) {
     char buf[4096];
@@ -1179,6 +2889,37 @@ int main(int argc, char **argv)
       rd.nl();
       gates = new pbm(buf);
 
+    } else if(keyw == "threads") {
+      threads = rd.gi();
+      rd.nl();
+
+    } else if(keyw == "chunk-memory") {
+      chunk_memory = rd.gi();
+      rd.nl();
+
+    } else if(keyw == "map-format") {
+      string format = rd.gw();
+      rd.nl();
+      if(format != "raw" && format != "tiled") {
+	fprintf(stderr, "Map format [%s] unknown\n", format.c_str());
+	exit(1);
+      }
+      tiled_map = format == "tiled";
+
+    } else if(keyw == "profile") {
+      profile_name = rd.gwnl();
+      rd.nl();
+
+    } else if(keyw == "roi") {
+      has_roi = true;
+      roi_x0 = rd.gi();
+      roi_y0 = rd.gi();
+      roi_x1 = rd.gi();
+      roi_y1 = rd.gi();
+      if(!rd.eol())
+	roi_margin = rd.gi();
+      rd.nl();
+
     } else if(keyw == "metal-link") {
       metal_link_info ml;
       ml.x1 = rd.gi();
@@ -1195,9 +2936,48 @@ int main(int argc, char **argv)
     }
   }
 
-  if(method)
-    method();
-  else
+  if(has_roi)
+    roi_apply(roi_x0, roi_y0, roi_x1, roi_y1, roi_margin);
+
+  if(method) {
+    time_info tinfo;
+    tinfo.stage("hashing layer tiles");
+    string tiles_name = string(map_name) + ".tiles";
+    tile_state old, cur;
+    tiles_compute(cur, argv[1]);
+    std::vector<char> dirty;
+    if(tiles_load(tiles_name.c_str(), old) && tiles_compare(old, cur, dirty))
+      fprintf(stderr, "Layers unchanged, extraction up to date.\n");
+    else {
+      remove(tiles_name.c_str());
+      string labels_name = string(map_name) + ".labels";
+      if(!dirty.empty()) {
+	int nd = 0, nb = dirty.size();
+	for(char d : dirty)
+	  nd += d;
+	previous = previous_load(labels_name.c_str(), dirty, method == nmos_metal_gate ? 2 : 3);
+	if(previous)
+	  fprintf(stderr, "Labeling %d of %d bands again\n", nd, nb);
+	else
+	  fprintf(stderr, "Previous labels missing or unusable, full extraction\n");
+      }
+      method(tinfo);
+      delete previous;
+      previous = NULL;
+      remove(labels_name.c_str());
+      if(rename((labels_name + ".tmp").c_str(), labels_name.c_str())) {
+	perror(labels_name.c_str());
+	exit(1);
+      }
+      tinfo.stage("saving layer tiles");
+      cur.map_size = file_size(map_name);
+      cur.list_size = file_size(list_name);
+      tiles_save(tiles_name.c_str(), cur);
+    }
+    tinfo.finish();
+    if(profile_name && !tinfo.report(profile_name, "generate-circuit"))
+      exit(1);
+  } else
     fprintf(stderr, "Method missing, nothing to do.\n");
 
   return 0;
@@ -0,0 +1,321 @@
+#include "BitState.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+enum { RANK_BITS_MAX = 16 };
+
+// Bit-sliced arithmetic on numbers stored as bit-planes, lowest bit
+// first, one bit per lane
+
+static void planes_set(BitState::lanes *p, int bits, int v, BitState::lanes mask)
+{
+  for(int b=0; b != bits; b++)
+    if((v >> b) & 1)
+      p[b] |= mask;
+    else
+      p[b] &= ~mask;
+}
+
+static void planes_select(BitState::lanes *p, const BitState::lanes *s, int bits, BitState::lanes mask)
+{
+  for(int b=0; b != bits; b++)
+    p[b] = (p[b] & ~mask) | (s[b] & mask);
+}
+
+// Lanes where a < b, and in eq the ones where a == b
+static BitState::lanes planes_less(const BitState::lanes *a, const BitState::lanes *b, int bits, BitState::lanes &eq)
+{
+  BitState::lanes lt = 0;
+  eq = ~BitState::lanes(0);
+  for(int i=bits-1; i >= 0; i--) {
+    lt |= eq & ~a[i] & b[i];
+    eq &= ~(a[i] ^ b[i]);
+  }
+  return lt;
+}
+
+// d = s+1, DIST_NONE staying DIST_NONE
+static void dist_next(BitState::lanes *d, const BitState::lanes *s)
+{
+  BitState::lanes carry = ~BitState::lanes(0);
+  for(int b=0; b != BitState::DIST_BITS; b++) {
+    d[b] = s[b] ^ carry;
+    carry &= s[b];
+  }
+  for(int b=0; b != BitState::DIST_BITS; b++)
+    d[b] |= carry;
+}
+
+BitState::BitState(const State &_state) : state(_state)
+{
+  const circuit_info &info = state.info;
+  int nnets = info.nnets;
+  max_iterations = state.max_iterations;
+
+  high.resize(nnets);
+  flt.resize(nnets);
+  dist.resize(int64_t(nnets)*DIST_BITS);
+  forced.resize(nnets);
+  forced_high.resize(nnets);
+  pending.resize(nnets);
+  influenced.resize(nnets);
+  queued.resize(nnets);
+
+  std::vector<int> tl;
+  std::vector<double> fl;
+  int max_rank = 0;
+  drive_index.resize(nnets+1);
+  pullup_rank.resize(nnets);
+  for(int i=0; i != nnets; i++) {
+    drive_index[i] = drive_gate.size();
+    tl.clear();
+    for(int t : info.term_trans(i)) {
+      const tinfo &ti = info.trans[t];
+      if(state.ignored[t] || ti.t1 == ti.t2)
+	continue;
+      tl.push_back(t);
+    }
+    std::stable_sort(tl.begin(), tl.end(), [&info](int a, int b) { return info.trans[a].f > info.trans[b].f; });
+
+    // Distinct strengths, strongest first
+    fl.clear();
+    for(int t : tl)
+      fl.push_back(info.trans[t].f);
+    if(state.pullup[i])
+      fl.push_back(1);
+    std::sort(fl.begin(), fl.end(), [](double a, double b) { return a > b; });
+    fl.erase(std::unique(fl.begin(), fl.end()), fl.end());
+    auto rank = [&fl](double f) { return int(std::find(fl.begin(), fl.end(), f) - fl.begin()); };
+
+    for(int t : tl) {
+      const tinfo &ti = info.trans[t];
+      drive_gate.push_back(ti.gate);
+      drive_other.push_back(ti.t1 == i ? ti.t2 : ti.t1);
+      drive_rank.push_back(rank(ti.f));
+      drive_weak.push_back(ti.f < 0.1);
+    }
+    pullup_rank[i] = state.pullup[i] ? rank(1) : 0;
+    if(max_rank < int(fl.size()))
+      max_rank = fl.size();
+  }
+  drive_index[nnets] = drive_gate.size();
+
+  rank_bits = 1;
+  while((1 << rank_bits) < max_rank)
+    rank_bits++;
+  if(rank_bits > RANK_BITS_MAX) {
+    fprintf(stderr, "Too many transistor strengths on one net (%d)\n", max_rank);
+    exit(1);
+  }
+
+  fanout_index.resize(nnets+1);
+  for(int i=0; i != nnets; i++) {
+    fanout_index[i] = fanout.size();
+    for(int t : info.gate_trans(i)) {
+      const tinfo &ti = info.trans[t];
+      fanout.push_back(ti.t1);
+      fanout.push_back(ti.t2);
+    }
+    for(int t : info.term_trans(i)) {
+      const tinfo &ti = info.trans[t];
+      int other = ti.t1 == i ? ti.t2 : ti.t1;
+      if(other != i)
+	fanout.push_back(other);
+    }
+    std::sort(fanout.begin() + fanout_index[i], fanout.end());
+    fanout.erase(std::unique(fanout.begin() + fanout_index[i], fanout.end()), fanout.end());
+  }
+  fanout_index[nnets] = fanout.size();
+
+  for(int i=0; i != nnets; i++) {
+    forced[i] = state.forced_power[i] != State::S_FLOAT ? ~lanes(0) : 0;
+    forced_high[i] = state.forced_power[i] == State::S_1 ? ~lanes(0) : 0;
+  }
+  reset_to_floating();
+}
+
+void BitState::reset_to_floating()
+{
+  for(int i=0; i != state.info.nnets; i++) {
+    high[i] = forced[i] & forced_high[i];
+    flt[i] = ~forced[i];
+    pending[i] = 0;
+  }
+  std::fill(dist.begin(), dist.end(), 0);
+}
+
+BitState::lanes BitState::reset_to_zero()
+{
+  for(int i=0; i != state.info.nnets; i++) {
+    high[i] = forced[i] & forced_high[i];
+    flt[i] = 0;
+    planes_set(dist.data() + int64_t(i)*DIST_BITS, DIST_BITS, DIST_NONE, ~forced[i]);
+    planes_set(dist.data() + int64_t(i)*DIST_BITS, DIST_BITS, 0, forced[i]);
+    pending[i] = ~lanes(0);
+  }
+  return settle();
+}
+
+void BitState::force(int net, lanes mask, int level)
+{
+  if(level == State::S_FLOAT) {
+    if(state.forced_power[net] == State::S_FLOAT) {
+      forced[net] &= ~mask;
+      pending[net] |= mask;
+    }
+    return;
+  }
+  forced[net] |= mask;
+  if(level == State::S_1) {
+    forced_high[net] |= mask;
+    high[net] |= mask;
+  } else {
+    forced_high[net] &= ~mask;
+    high[net] &= ~mask;
+  }
+  flt[net] &= ~mask;
+  pending[net] |= mask;
+}
+
+int BitState::get(int net, int lane) const
+{
+  lanes bit = lanes(1) << lane;
+  if(flt[net] & bit)
+    return State::S_FLOAT;
+  return high[net] & bit ? State::S_1 : State::S_0;
+}
+
+// State::apply_changed's worklist, the lanes of a net being resolved
+// when a net it depends on changed in the same lanes.  pending holds
+// the lanes each net of changed_nets changed in.
+BitState::lanes BitState::settle()
+{
+  int nnets = state.info.nnets;
+  changed_nets.clear();
+  for(int i=0; i != nnets; i++)
+    if(pending[i])
+      changed_nets.push_back(i);
+
+  lanes nd[DIST_BITS];
+  int count = 0;
+  while(!changed_nets.empty() && count < max_iterations) {
+    influenced_nets.clear();
+    for(int net : changed_nets) {
+      lanes m = pending[net];
+      pending[net] = 0;
+      for(int i = fanout_index[net]; i != fanout_index[net+1]; i++) {
+	int n = fanout[i];
+	if(!queued[n]) {
+	  queued[n] = true;
+	  influenced_nets.push_back(n);
+	}
+	influenced[n] |= m;
+      }
+    }
+    std::sort(influenced_nets.begin(), influenced_nets.end());
+
+    changed_nets.clear();
+    for(int net : influenced_nets) {
+      queued[net] = false;
+      lanes open = influenced[net] & ~forced[net];
+      influenced[net] = 0;
+      if(!open)
+	continue;
+      lanes nh, nf;
+      lanes c = resolve(net, open, nh, nf, nd);
+      if(!c)
+	continue;
+      high[net] = (high[net] & ~c) | (nh & c);
+      flt[net] = (flt[net] & ~c) | (nf & c);
+      planes_select(dist.data() + int64_t(net)*DIST_BITS, nd, DIST_BITS, c);
+      pending[net] = c;
+      changed_nets.push_back(net);
+    }
+    count++;
+  }
+
+  lanes failed = 0;
+  for(int net : changed_nets) {
+    failed |= pending[net];
+    pending[net] = 0;
+  }
+  if(failed)
+    fprintf(stderr, "Convergence failure\n");
+  return failed;
+}
+
+// State::resolve on the open lanes of a net.  The drivers are visited
+// by decreasing strength, so keeping the first one at the smallest
+// distance keeps the strongest one.  Returns the open lanes where the
+// level or the distance changes, with the new ones in nh, nf and nd.
+BitState::lanes BitState::resolve(int net, lanes open, lanes &nh, lanes &nf, lanes *nd) const
+{
+  lanes has0 = 0, has1 = 0, weak1 = 0, eq;
+  lanes d0[DIST_BITS] = {}, d1[DIST_BITS] = {}, cand[DIST_BITS];
+  lanes r0[RANK_BITS_MAX] = {}, r1[RANK_BITS_MAX] = {};
+
+  // Gates conduct when high, whatever the ttype, as in State::resolve
+  for(int i = drive_index[net]; i != drive_index[net+1]; i++) {
+    lanes on = high[drive_gate[i]] & open;
+    if(!on)
+      continue;
+    int other = drive_other[i];
+    lanes c1 = on & high[other];
+    lanes c0 = on & ~high[other] & ~flt[other];
+    if(!(c0 | c1))
+      continue;
+    dist_next(cand, dist.data() + int64_t(other)*DIST_BITS);
+    if(c0) {
+      lanes u = c0 & (~has0 | planes_less(cand, d0, DIST_BITS, eq));
+      planes_select(d0, cand, DIST_BITS, u);
+      planes_set(r0, rank_bits, drive_rank[i], u);
+      has0 |= c0;
+    }
+    if(c1) {
+      lanes u = c1 & (~has1 | planes_less(cand, d1, DIST_BITS, eq));
+      planes_select(d1, cand, DIST_BITS, u);
+      planes_set(r1, rank_bits, drive_rank[i], u);
+      weak1 = (weak1 & ~u) | (drive_weak[i] ? u : 0);
+      has1 |= c1;
+    }
+  }
+
+  // The pullup replaces all the 1 drives but the strong direct ones
+  if(state.pullup[net]) {
+    lanes far = 0;
+    for(int b=1; b != DIST_BITS; b++)
+      far |= d1[b];
+    lanes p = open & (~has1 | far | (d1[0] & weak1));
+    planes_set(d1, DIST_BITS, 100, p);
+    planes_set(r1, rank_bits, pullup_rank[net], p);
+    has1 |= p;
+  }
+
+  // 0 wins on equal distance when at least as strong
+  lanes lt = planes_less(d0, d1, DIST_BITS, eq);
+  lanes eqd = eq;
+  lanes weaker = planes_less(r1, r0, rank_bits, eq);
+  lanes z = has0 & (~has1 | lt | (eqd & ~weaker));
+  lanes o = has1 & ~z;
+  lanes none = ~(has0 | has1);
+
+  nh = o | (none & high[net]);
+  nf = none & flt[net];
+  for(int b=0; b != DIST_BITS; b++)
+    nd[b] = d0[b];
+  planes_select(nd, d1, DIST_BITS, o);
+  planes_set(nd, DIST_BITS, DIST_NONE, none);
+
+  lanes limit[DIST_BITS] = {};
+  planes_set(limit, DIST_BITS, 500, ~lanes(0));
+  planes_set(nd, DIST_BITS, DIST_NONE, planes_less(limit, nd, DIST_BITS, eq));
+
+  const lanes *cd = dist.data() + int64_t(net)*DIST_BITS;
+  lanes diff = (nh ^ high[net]) | (nf ^ flt[net]);
+  for(int b=0; b != DIST_BITS; b++)
+    diff |= nd[b] ^ cd[b];
+  return diff & open;
+}
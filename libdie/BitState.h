@@ -0,0 +1,85 @@
+#ifndef BITSTATE_H
+#define BITSTATE_H
+
+#include "State.h"
+
+#include <vector>
+#include <stdint.h>
+
+// Bit-parallel version of the in-place engine of State, simulating 64
+// independent scenarios ("lanes") at once.  Each net level is two
+// bit-planes and each drive distance DIST_BITS bit-planes, one bit per
+// lane, the distances past 500 being stored as DIST_NONE, State's
+// 100000.  The transistor classification (ignored, pullup, quasi_vcc)
+// and the default forced nets come from the State.
+//
+// settle() is State::apply_changed on every lane: each iteration
+// resolves, in net order and in place, the lanes of the nets
+// influenced by the lanes that changed in the previous one, with the
+// rules of State::resolve.  A lane goes through the same levels as
+// State does, so a latch settles the same way.  The cycle detection is
+// not reproduced: the lanes that still change after max_iterations
+// are returned, where State would have floated the cycle.
+
+class BitState {
+public:
+  typedef uint64_t lanes;
+  enum { LANES = 64, DIST_BITS = 9, DIST_NONE = (1 << DIST_BITS) - 1 };
+
+  const State &state;
+
+  // Per net: level is 1 in "high", floating in "flt" (high is then 0)
+  std::vector<lanes> high, flt;
+
+  // Per net, DIST_BITS planes from the lowest bit: drive distance
+  std::vector<lanes> dist;
+
+  // Per net: lanes where the net is forced, and to which level
+  std::vector<lanes> forced, forced_high;
+
+  int max_iterations;
+
+  BitState(const State &state);
+
+  void reset_to_floating();
+
+  // Returns the lanes that did not converge
+  lanes reset_to_zero();
+
+  // Force the lanes of a net to S_0/S_1, S_FLOAT releases them
+  // (the net is then driven by the circuit again).  Lanes forced by
+  // the State stay forced.  As with State::force the distance is
+  // kept.  The next settle() propagates all the forces since the
+  // previous one together.
+  void force(int net, lanes mask, int level);
+
+  int get(int net, int lane) const;
+
+  // Returns the lanes that did not converge in max_iterations
+  lanes settle();
+
+private:
+  // Non-ignored terminal transistors of each net by decreasing
+  // strength, the gate and the other terminal of each, and the rank
+  // of its strength among the ones of the net.  The pullup of a net
+  // has the rank of a strength of 1, weak[i] is set when the drive is
+  // one the pullup replaces at distance 1.
+  std::vector<int> drive_index, drive_gate, drive_other, drive_rank;
+  std::vector<char> drive_weak;
+  std::vector<int> pullup_rank;
+  int rank_bits;
+
+  // Nets influenced by a change of each net, as State::queue_influenced
+  // lists them
+  std::vector<int> fanout_index, fanout;
+
+  // Lanes changed per net since the last settle, the worklist of the
+  // iterations and its flags
+  std::vector<lanes> pending, influenced;
+  std::vector<int> changed_nets, influenced_nets;
+  std::vector<bool> queued;
+
+  lanes resolve(int net, lanes open, lanes &nh, lanes &nf, lanes *nd) const;
+};
+
+#endif
@@ -3,25 +3,121 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Threads resolving the components of a wave along with the calling
+// one.  Components are handed out in small batches.
+struct State::wave_pool {
+  enum { BATCH = 16 };
+
+  State *state;
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wake, done;
+  std::atomic<int> next_slot;
+  int slots, busy, generation;
+  bool verbose, quit;
+
+  wave_pool(State *state, int count);
+  ~wave_pool();
+  void run(int slots, bool verbose);
+  void work();
+  void worker();
+};
+
+State::wave_pool::wave_pool(State *_state, int count)
+{
+  state = _state;
+  slots = busy = generation = 0;
+  verbose = quit = false;
+  for(int i=0; i != count; i++)
+    workers.push_back(std::thread(&wave_pool::worker, this));
+}
+
+State::wave_pool::~wave_pool()
+{
+  {
+    std::lock_guard<std::mutex> l(lock);
+    quit = true;
+  }
+  wake.notify_all();
+  for(auto &t : workers)
+    t.join();
+}
+
+void State::wave_pool::work()
+{
+  for(;;) {
+    int k = next_slot.fetch_add(BATCH);
+    if(k >= slots)
+      break;
+    int e = std::min(k + int(BATCH), slots);
+    for(; k != e; k++)
+      state->resolve_component(k, verbose);
+  }
+}
+
+void State::wave_pool::worker()
+{
+  int seen = 0;
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      wake.wait(l, [&] { return quit || generation != seen; });
+      if(quit)
+	return;
+      seen = generation;
+    }
+    work();
+    std::lock_guard<std::mutex> l(lock);
+    if(!--busy)
+      done.notify_one();
+  }
+}
+
+void State::wave_pool::run(int _slots, bool _verbose)
+{
+  {
+    std::lock_guard<std::mutex> l(lock);
+    slots = _slots;
+    verbose = _verbose;
+    next_slot = 0;
+    busy = workers.size();
+    generation++;
+  }
+  wake.notify_all();
+  work();
+  std::unique_lock<std::mutex> l(lock);
+  done.wait(l, [&] { return !busy; });
+}
+
 State::State(const char *info_path, const char *cmap_path, const char *pins_path, bool _cmos) :
   info(info_path),
   cmap(cmap_path, info.nl, info.sx, info.sy, false),
   ninfo(pins_path, cmap, info)
 {
   cmos = _cmos;
+  max_iterations = 1100;
+  threads = 0;
+  pool = nullptr;
+  journaling = false;
   vcc = ninfo.nets["vcc"];
   gnd = ninfo.nets["gnd"];
 
   ttype.resize(info.trans.size());
   ignored.resize(info.trans.size());
 
-  quasi_vcc.resize(info.nets.size());
-  pullup.resize(info.nets.size());
-  pulldown.resize(info.nets.size());
-  display.resize(info.nets.size());
-  oscillator.resize(info.nets.size());
+  quasi_vcc.resize(info.nnets);
+  pullup.resize(info.nnets);
+  pulldown.resize(info.nnets);
+  display.resize(info.nnets);
+  oscillator.resize(info.nnets);
 
-  for(unsigned int i=0; i != info.nets.size(); i++) {
+  for(int i=0; i != info.nnets; i++) {
     quasi_vcc[i] = false;
     pullup[i] = false;
     pulldown[i] = false;
@@ -34,7 +130,7 @@ State::State(const char *info_path, const char *cmap_path, const char *pins_path
     ignored[i] = false;
   }
 
-  for(unsigned int i=0; i != info.nets.size(); i++)
+  for(int i=0; i != info.nnets; i++)
     if(ninfo.names[i].substr(0, 3) == "osc")
       oscillator[i] = true;
 
@@ -96,145 +192,512 @@ State::State(const char *info_path, const char *cmap_path, const char *pins_path
     }
   }
 
-  forced_power.resize(info.nets.size());
-  power.resize(info.nets.size());
-  power_dist.resize(info.nets.size());
-  for(unsigned int i=0; i != info.nets.size(); i++)
+  forced_power.resize(info.nnets);
+  power.resize(info.nnets);
+  power_dist.resize(info.nnets);
+  for(int i=0; i != info.nnets; i++)
     forced_power[i] = quasi_vcc[i] || oscillator[i] ? S_1 : S_FLOAT;
   forced_power[gnd] = S_0;
+  build_components();
   reset_to_floating();
 }
 
-void State::reset_to_floating()
+State::~State()
 {
-  power = forced_power;
-  std::set<int> changed;
-  memset(&power_dist[0], 0, sizeof(int)*info.nets.size());
-  for(unsigned int i=0; i != forced_power.size(); i++)
-    if(forced_power[i] != S_FLOAT)
-      changed.insert(i);
-  //  apply_changed(changed);
+  delete pool;
 }
 
-void State::reset_to_zero()
+static int ccc_find(std::vector<int> &parent, int net)
+{
+  while(parent[net] != net) {
+    parent[net] = parent[parent[net]];
+    net = parent[net];
+  }
+  return net;
+}
+
+void State::build_components()
 {
-  std::set<int> changed;
-  for(unsigned int i=0; i != forced_power.size(); i++) {
-    changed.insert(i);
-    if(forced_power[i] != S_FLOAT) {
+  std::vector<int> parent(info.nnets);
+  for(int i=0; i != info.nnets; i++)
+    parent[i] = i;
+
+  for(unsigned int i=0; i != info.trans.size(); i++) {
+    const tinfo &ti = info.trans[i];
+    if(ignored[i] || forced_power[ti.t1] != S_FLOAT || forced_power[ti.t2] != S_FLOAT)
+      continue;
+    int r1 = ccc_find(parent, ti.t1);
+    int r2 = ccc_find(parent, ti.t2);
+    // Keep the smallest net as the root
+    if(r1 < r2)
+      parent[r2] = r1;
+    else
+      parent[r1] = r2;
+  }
+
+  // Components are numbered in order of their first net
+  int nc = 0;
+  net_ccc.resize(info.nnets);
+  for(int i=0; i != info.nnets; i++) {
+    int r = ccc_find(parent, i);
+    net_ccc[i] = r == i ? nc++ : net_ccc[r];
+  }
+
+  ccc_index.assign(nc+1, 0);
+  for(int i=0; i != info.nnets; i++)
+    ccc_index[net_ccc[i]+1]++;
+  for(int i=0; i != nc; i++)
+    ccc_index[i+1] += ccc_index[i];
+  ccc_nets.resize(info.nnets);
+  std::vector<int> pos(ccc_index.begin(), ccc_index.end()-1);
+  for(int i=0; i != info.nnets; i++)
+    ccc_nets[pos[net_ccc[i]]++] = i;
+}
+
+void State::reset_to_floating()
+{
+  for(int i=0; i != info.nnets; i++)
+    if(power[i] != forced_power[i] || power_dist[i]) {
+      record(i);
       power[i] = forced_power[i];
       power_dist[i] = 0;
-    } else {
-      power[i] = S_0;
-      power_dist[i] = 100000;
+    }
+}
+
+void State::reset_to_zero()
+{
+  std::vector<int> changed;
+  for(int i=0; i != info.nnets; i++) {
+    changed.push_back(i);
+    int p = forced_power[i] != S_FLOAT ? forced_power[i] : S_0;
+    int d = forced_power[i] != S_FLOAT ? 0 : 100000;
+    if(power[i] != p || power_dist[i] != d) {
+      record(i);
+      power[i] = p;
+      power_dist[i] = d;
     }
   }
   apply_changed(changed);
 }
 
-void State::apply_changed(std::set<int> changed)
+void State::apply_changed(int net)
 {
-  int count = 0;
-  while(!changed.empty() && count < 1100) {
-    bool verbose = count > 1000;
-    std::set<int> influenced;
-    for(auto i = changed.begin(); i != changed.end(); i++) {
-      int net = *i;
-      auto j = info.gate_to_trans.find(net);
-      if(j != info.gate_to_trans.end()) {
-	for(auto k = j->second.begin(); k != j->second.end(); k++) {
-	  const tinfo &ti = info.trans[*k];
-	  influenced.insert(ti.t1);
-	  influenced.insert(ti.t2);
-	}
+  std::vector<int> changed;
+  changed.push_back(net);
+  apply_changed(changed);
+}
+
+void State::apply_changed(const std::set<int> &changed)
+{
+  apply_changed(std::vector<int>(changed.begin(), changed.end()));
+}
+
+void State::force(int net, int level)
+{
+  record(net);
+  forced_power[net] = level;
+  if(level != S_FLOAT)
+    power[net] = level;
+  apply_changed(net);
+}
+
+void State::revert(const std::vector<change> &changes)
+{
+  for(auto i = changes.rbegin(); i != changes.rend(); i++) {
+    record(i->net);
+    power[i->net] = i->power;
+    power_dist[i->net] = i->power_dist;
+    forced_power[i->net] = i->forced_power;
+  }
+}
+
+static const char state_magic[8] = "DSTATE\n";
+
+bool State::save(const char *fname) const
+{
+  FILE *fd = fopen(fname, "wb");
+  if(!fd) {
+    perror(fname);
+    return false;
+  }
+  int32_t nn = info.nnets;
+  bool ok =
+    fwrite(state_magic, 8, 1, fd) == 1 &&
+    fwrite(&nn, 4, 1, fd) == 1 &&
+    fwrite(power.data(), sizeof(int)*nn, 1, fd) == 1 &&
+    fwrite(power_dist.data(), sizeof(int)*nn, 1, fd) == 1 &&
+    fwrite(forced_power.data(), sizeof(int)*nn, 1, fd) == 1;
+  if(fclose(fd))
+    ok = false;
+  if(!ok)
+    fprintf(stderr, "%s: error writing the state\n", fname);
+  return ok;
+}
+
+// Only the nets that differ are updated, and journaled.
+bool State::load(const char *fname)
+{
+  FILE *fd = fopen(fname, "rb");
+  if(!fd) {
+    perror(fname);
+    return false;
+  }
+  char magic[8];
+  int32_t nn;
+  std::vector<int> p(info.nnets), pd(info.nnets), fp(info.nnets);
+  bool ok =
+    fread(magic, 8, 1, fd) == 1 && !memcmp(magic, state_magic, 8) &&
+    fread(&nn, 4, 1, fd) == 1 && nn == info.nnets &&
+    fread(p.data(), sizeof(int)*nn, 1, fd) == 1 &&
+    fread(pd.data(), sizeof(int)*nn, 1, fd) == 1 &&
+    fread(fp.data(), sizeof(int)*nn, 1, fd) == 1;
+  fclose(fd);
+  if(!ok) {
+    fprintf(stderr, "%s: not a state file for this die\n", fname);
+    return false;
+  }
+  for(int i=0; i != info.nnets; i++)
+    if(power[i] != p[i] || power_dist[i] != pd[i] || forced_power[i] != fp[i]) {
+      record(i);
+      power[i] = p[i];
+      power_dist[i] = pd[i];
+      forced_power[i] = fp[i];
+    }
+  return true;
+}
+
+// Compute the level a net settles to from its drivers.  Returns true
+// when it differs from the current one.  When a component is given,
+// the nets before this one come from next_power/next_dist and the
+// ones after from the start of the wave, as the in-place engine would
+// see them.  Reading a wave net of another component resolved before
+// this one sets cross, the result is then to be thrown away.
+bool State::resolve(int net, int ccc, bool redo, int &new_state, int &new_dist, bool &cross, bool verbose) const
+{
+  // Only the nets of the wave have levels in next_power/next_dist
+  auto newer = [&](int n) {
+    if(ccc == -1 || n > net || !(in_wave[n >> 6] & (uint64_t(1) << (n & 63))))
+      return false;
+    if(!redo && net_ccc[n] != ccc) {
+      cross = true;
+      return false;
+    }
+    return true;
+  };
+
+  double drive_0 = 0, drive_1 = 0;
+  int dist_0 = -1, dist_1 = -1;
+  for(int t : info.term_trans(net)) {
+    const tinfo &ti = info.trans[t];
+    if(ignored[t])
+      continue;
+    int pg = newer(ti.gate) ? next_power[ti.gate] : power[ti.gate];
+    if(pg == S_0 || pg == S_FLOAT)
+      continue;
+    int other = ti.t1 == net ? ti.t2 : ti.t1;
+    if(other == net)
+      continue;
+    bool local = newer(other);
+    int po = local ? next_power[other] : power[other];
+    if(po == S_FLOAT)
+      continue;
+    int pd = local ? next_dist[other] : power_dist[other];
+    if(verbose)
+      fprintf(stderr, "net %d drive from %s through %s type=%d dist=%d force=%g\n", net, ninfo.net_name(other).c_str(), ninfo.net_name(ti.gate).c_str(), po, pd+1, ti.f);
+    if(po == S_0) {
+      if(dist_0 == -1 || dist_0 > pd+1 || (dist_0 == pd+1 && drive_0 < ti.f)) {
+	dist_0 = pd+1;
+	drive_0 = ti.f;
       }
-      j = info.term_to_trans.find(net);
-      if(j != info.term_to_trans.end()) {
-	for(auto k = j->second.begin(); k != j->second.end(); k++) {
-	  const tinfo &ti = info.trans[*k];
-	  int other = ti.t1 == net ? ti.t2 : ti.t1;
-	  if(other != net)
-	    influenced.insert(other);
-	}
+    } else {
+      if(dist_1 == -1 || dist_1 > pd+1 || (dist_1 == pd+1 && drive_1 < ti.f)) {
+	dist_1 = pd+1;
+	drive_1 = ti.f;
       }
     }
+  }
+  int cur_state = ccc != -1 ? next_power[net] : power[net];
+  int cur_dist = ccc != -1 ? next_dist[net] : power_dist[net];
+  if(pullup[net]) {
+    if(dist_1 == -1 || dist_1 >= 2 || (dist_1 == 1 && drive_1 < 0.1)) {
+      drive_1 = 1;
+      dist_1 = 100;
+    }
+  }
+  if(dist_0 == -1 && dist_1 == -1) {
+    new_state = cur_state;
+    new_dist = 100000;
+  } else if(dist_0 == -1 && dist_1 != -1) {
+    new_state = S_1;
+    new_dist = dist_1;
+  } else if(dist_0 != -1 && dist_1 == -1) {
+    new_state = S_0;
+    new_dist = dist_0;
+  } else {
+    if(dist_0 < dist_1 || (dist_0 == dist_1 && drive_0 >= drive_1)) {
+      new_state = S_0;
+      new_dist = dist_0;
+    } else {
+      new_state = S_1;
+      new_dist = dist_1;
+    }
+  }
+  if(new_dist > 500)
+    new_dist = 100000;
+  if(new_state == cur_state && new_dist == cur_dist)
+    return false;
+  if(verbose)
+    fprintf(stderr, "net %d: %d.%d -> %d.%d (%d %g  %d %g)\n", net, cur_state, cur_dist, new_state, new_dist, dist_0, drive_0, dist_1, drive_1);
+  return true;
+}
 
-    if(0)
-      fprintf(stderr, "%d changed, %d influenced\n", int(changed.size()), int(influenced.size()));
-    changed.clear();
-    for(auto i = influenced.begin(); i != influenced.end(); i++) {
-      int net = *i;
-      if(forced_power[*i] != S_FLOAT)
-	continue;
-      double drive_0 = 0, drive_1 = 0;
-      int dist_0 = -1, dist_1 = -1;
-      auto j = info.term_to_trans.find(*i);
-      if(j != info.term_to_trans.end()) {
-	for(auto k = j->second.begin(); k != j->second.end(); k++) {
-	  const tinfo &ti = info.trans[*k];
-	  if(ignored[*k])
-	    continue;
-	  if(power[ti.gate] == S_0 || power[ti.gate] == S_FLOAT)
-	    continue;
-	  int other = ti.t1 == net ? ti.t2 : ti.t1;
-	  if(other == net)
-	    continue;
-	  if(power[other] == S_FLOAT)
-	    continue;
-	  int pd = power_dist[other];
-	  if(verbose)
-	    fprintf(stderr, "net %d drive from %s through %s type=%d dist=%d force=%g\n", net, ninfo.net_name(other).c_str(), ninfo.net_name(ti.gate).c_str(), power[other], pd+1, ti.f);
-	  if(power[other] == S_0) {
-	    if(dist_0 == -1 || dist_0 > pd+1 || (dist_0 == pd+1 && drive_0 < ti.f)) {
-	      dist_0 = pd+1;
-	      drive_0 = ti.f;
-	    }
-	  } else {
-	    if(dist_1 == -1 || dist_1 > pd+1 || (dist_1 == pd+1 && drive_1 < ti.f)) {
-	      dist_1 = pd+1;
-	      drive_1 = ti.f;
-	    }
-	  }
+void State::queue(int net)
+{
+  uint64_t bit = uint64_t(1) << (net & 63);
+  if(!(queued[net >> 6] & bit)) {
+    queued[net >> 6] |= bit;
+    influenced_nets.push_back(net);
+  }
+}
+
+// Collect in influenced_nets, in net order, the nets influenced by
+// the ones in changed_nets.  They stay flagged in queued.
+void State::queue_influenced()
+{
+  influenced_nets.clear();
+  for(int net : changed_nets) {
+    for(int t : info.gate_trans(net)) {
+      const tinfo &ti = info.trans[t];
+      queue(ti.t1);
+      queue(ti.t2);
+    }
+    for(int t : info.term_trans(net)) {
+      const tinfo &ti = info.trans[t];
+      int other = ti.t1 == net ? ti.t2 : ti.t1;
+      if(other != net)
+	queue(other);
+    }
+  }
+
+  // Sorting is needed for the in-place updates to happen in the
+  // same order every time.  Big waves are cheaper to pick back from
+  // the flags.
+  if(influenced_nets.size() * 16 > queued.size() * 64) {
+    influenced_nets.clear();
+    for(unsigned int w=0; w != queued.size(); w++)
+      for(uint64_t bits = queued[w]; bits; bits &= bits-1)
+	influenced_nets.push_back((w << 6) | __builtin_ctzll(bits));
+  } else
+    std::sort(influenced_nets.begin(), influenced_nets.end());
+
+  if(0)
+    fprintf(stderr, "%d changed, %d influenced\n", int(changed_nets.size()), int(influenced_nets.size()));
+}
+
+// Worklist propagation.  Each iteration evaluates, in net order, the
+// nets influenced by the ones that changed in the previous iteration,
+// updating them in place.
+void State::apply_changed(const std::vector<int> &changed)
+{
+  if(queued.empty())
+    queued.resize((info.nnets + 63) >> 6);
+  changed_nets = changed;
+  start_cycle_detection();
+
+  if(threads)
+    apply_levelized();
+
+  else {
+    int count = 0;
+    bool detect = true;
+    while(!changed_nets.empty() && count < max_iterations) {
+      bool verbose = count > max_iterations - 100;
+      queue_influenced();
+      changed_nets.clear();
+      for(int net : influenced_nets) {
+	queued[net >> 6] &= ~(uint64_t(1) << (net & 63));
+	if(forced_power[net] != S_FLOAT || in_cycle(net))
+	  continue;
+	int new_state, new_dist;
+	bool cross;
+	if(resolve(net, -1, false, new_state, new_dist, cross, verbose)) {
+	  set_level(net, new_state, new_dist);
+	  changed_nets.push_back(net);
 	}
       }
-      if(pullup[net]) {
-	if(dist_1 == -1 || dist_1 >= 2 || (dist_1 == 1 && drive_1 < 0.1)) {
-	  drive_1 = 1;
-	  dist_1 = 100;
-	}
+      count++;
+      if(detect && find_cycle(count))
+	detect = false;
+    }
+  }
+
+  if(!changed_nets.empty()) {
+    fprintf(stderr, "Convergence failure\n");
+    changed_nets.clear();
+  }
+}
+
+void State::resolve_component(int slot, bool verbose)
+{
+  bool cross = false;
+  for(int i = wave_index[slot]; i != wave_index[slot+1]; i++) {
+    int net = wave_nets[i];
+    int new_state, new_dist;
+    if(resolve(net, net_ccc[net], false, new_state, new_dist, cross, verbose)) {
+      next_power[net] = new_state;
+      next_dist[net] = new_dist;
+    }
+  }
+  slot_redo[slot] = cross;
+}
+
+// Levelized propagation.  The nets of a wave are grouped by
+// component and each group is resolved in net order with in-place
+// updates.  Groups that read nothing another group changed earlier in
+// the wave are independent.  The others are redone together in net
+// order afterwards, which gives the levels of the in-place engine.
+// The new levels are merged back in net order at the end of the wave.
+// Only the nets of the wave are copied to next_power/next_dist, the
+// others are read from power/power_dist.
+void State::apply_levelized()
+{
+  if(threads > 1 && (!pool || int(pool->workers.size()) != threads-1)) {
+    delete pool;
+    pool = new wave_pool(this, threads-1);
+  }
+  if(ccc_slot.empty())
+    ccc_slot.assign(ccc_index.size()-1, -1);
+  if(in_wave.empty())
+    in_wave.resize(queued.size());
+  if(next_power.empty()) {
+    next_power.resize(info.nnets);
+    next_dist.resize(info.nnets);
+  }
+
+  int count = 0;
+  bool detect = true;
+  while(!changed_nets.empty() && count < max_iterations) {
+    bool verbose = count > max_iterations - 100;
+    queue_influenced();
+
+    wave_index.clear();
+    for(int net : influenced_nets) {
+      queued[net >> 6] &= ~(uint64_t(1) << (net & 63));
+      if(forced_power[net] != S_FLOAT || in_cycle(net))
+	continue;
+      int c = net_ccc[net];
+      if(ccc_slot[c] == -1) {
+	ccc_slot[c] = wave_index.size();
+	wave_index.push_back(0);
       }
-      int new_state;
-      int new_dist;
-      if(dist_0 == -1 && dist_1 == -1) {
-	new_state = power[net];
-	new_dist = 100000;
-      } else if(dist_0 == -1 && dist_1 != -1) {
-	new_state = S_1;
-	new_dist = dist_1;
-      } else if(dist_0 != -1 && dist_1 == -1) {
-	new_state = S_0;
-	new_dist = dist_0;
-      } else {
-	if(dist_0 < dist_1 || (dist_0 == dist_1 && drive_0 >= drive_1)) {
-	  new_state = S_0;
-	  new_dist = dist_0;
-	} else {
-	  new_state = S_1;
-	  new_dist = dist_1;
+      wave_index[ccc_slot[c]]++;
+    }
+
+    int slots = wave_index.size();
+    int total = 0;
+    for(int i=0; i != slots; i++) {
+      int n = wave_index[i];
+      wave_index[i] = total;
+      total += n;
+    }
+    wave_index.push_back(total);
+    wave_nets.resize(total);
+    for(int net : influenced_nets)
+      if(forced_power[net] == S_FLOAT && !in_cycle(net))
+	wave_nets[wave_index[ccc_slot[net_ccc[net]]]++] = net;
+    for(int i = slots; i; i--)
+      wave_index[i] = wave_index[i-1];
+    wave_index[0] = 0;
+    for(int net : wave_nets) {
+      ccc_slot[net_ccc[net]] = -1;
+      in_wave[net >> 6] |= uint64_t(1) << (net & 63);
+      next_power[net] = power[net];
+      next_dist[net] = power_dist[net];
+    }
+
+    slot_redo.resize(slots);
+    if(pool && slots >= 4*wave_pool::BATCH)
+      pool->run(slots, verbose);
+    else
+      for(int i=0; i != slots; i++)
+	resolve_component(i, verbose);
+
+    // The redone nets read every net of the wave before them from
+    // next_power/next_dist
+    redo_nets.clear();
+    for(int i=0; i != slots; i++)
+      if(slot_redo[i])
+	for(int j = wave_index[i]; j != wave_index[i+1]; j++) {
+	  int net = wave_nets[j];
+	  next_power[net] = power[net];
+	  next_dist[net] = power_dist[net];
+	  redo_nets.push_back(net);
 	}
+    std::sort(redo_nets.begin(), redo_nets.end());
+    for(int net : redo_nets) {
+      int new_state, new_dist;
+      bool cross;
+      if(resolve(net, net_ccc[net], true, new_state, new_dist, cross, verbose)) {
+	next_power[net] = new_state;
+	next_dist[net] = new_dist;
       }
-      if(new_dist > 500)
-	new_dist = 100000;
-      if(new_state != power[net] || new_dist != power_dist[net]) {
-	if(verbose)
-	  fprintf(stderr, "net %d: %d.%d -> %d.%d (%d %g  %d %g)\n", net, power[net], power_dist[net], new_state, new_dist, dist_0, drive_0, dist_1, drive_1);
-	power[net] = new_state;
-	power_dist[net] = new_dist;
-	changed.insert(net);
+    }
+
+    changed_nets.clear();
+    for(int net : influenced_nets) {
+      uint64_t bit = uint64_t(1) << (net & 63);
+      if(!(in_wave[net >> 6] & bit))
+	continue;
+      in_wave[net >> 6] &= ~bit;
+      if(next_power[net] != power[net] || next_dist[net] != power_dist[net]) {
+	set_level(net, next_power[net], next_dist[net]);
+	changed_nets.push_back(net);
       }
     }
     count++;
-  }  
-  if(count == 1100)
-    fprintf(stderr, "Convergence failure\n");
+    if(detect && find_cycle(count))
+      detect = false;
+  }
+}
+
+void State::start_cycle_detection()
+{
+  cycle_nets.clear();
+  level_hash = 0;
+  seen_states.clear();
+  wave_log.clear();
+  wave_log_index.clear();
+  wave_log_index.push_back(0);
+  find_cycle(0);
+}
+
+// The next iteration only depends on the levels and on the nets that
+// just changed, so seeing both again means the propagation is going
+// round in circles.  Returns true after floating the nets changed
+// during the cycle.  They become the changed nets, so that their
+// fanout settles in the following iterations, which run without
+// detection and leave the cycle nets alone.
+bool State::find_cycle(int count)
+{
+  uint64_t key = mix(level_hash + 0x9e3779b97f4a7c15ULL);
+  for(int net : changed_nets)
+    key ^= level_key(net, power[net], power_dist[net]);
+  if(count) {
+    wave_log.insert(wave_log.end(), changed_nets.begin(), changed_nets.end());
+    wave_log_index.push_back(wave_log.size());
+  }
+
+  auto seen = seen_states.emplace(key, count);
+  if(seen.second || changed_nets.empty())
+    return false;
+
+  int start = seen.first->second;
+  cycle_nets.assign(wave_log.begin() + wave_log_index[start], wave_log.end());
+  std::sort(cycle_nets.begin(), cycle_nets.end());
+  cycle_nets.erase(std::unique(cycle_nets.begin(), cycle_nets.end()), cycle_nets.end());
+  fprintf(stderr, "Oscillation of period %d over %d nets\n", count - start, int(cycle_nets.size()));
+  for(int net : cycle_nets)
+    set_level(net, S_FLOAT, 100000);
+  changed_nets = cycle_nets;
+  return true;
 }
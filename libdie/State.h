@@ -5,7 +5,11 @@
 #include "circuit_info.h"
 #include "net_info.h"
 
+#include <algorithm>
 #include <set>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
 
 class State {
 public:
@@ -26,12 +30,116 @@ public:
   std::vector<int> forced_power;
   std::vector<int> power;
   std::vector<int> power_dist;
+  int max_iterations;
+
+  // 0 selects the in-place engine.  1 or more selects the levelized
+  // one, where each wave is resolved one channel-connected component
+  // at a time on that many threads.  Both give the same levels: the
+  // components that depend on a gate another one resolved earlier in
+  // the wave are redone in net order.
+  int threads;
+
+  // While journaling, every change to a net records the values it had
+  // before, in order.  Reverting a list of changes restores them and
+  // journals the reverse list.
+  struct change {
+    int net, power, power_dist, forced_power;
+  };
+  std::vector<change> journal;
+  bool journaling;
+
+  // When apply_changed finds the levels going round in a cycle, it
+  // leaves the nets changing in the cycle floating, lists them here
+  // and settles the rest of the circuit around them.  Empty when the
+  // last propagation had no cycle.
+  std::vector<int> cycle_nets;
+
+  // Channel-connected components: nets linked through the terminals
+  // of non-ignored transistors, split at the nets forced at load time
+  // (vcc, gnd, quasi-vcc, oscillators) which are components of their
+  // own.  Members of component c are ccc_nets[ccc_index[c]] up to
+  // ccc_nets[ccc_index[c+1]], in net order.
+  std::vector<int> net_ccc;
+  std::vector<int> ccc_index, ccc_nets;
 
   State(const char *info_path, const char *cmap_path, const char *pins_path, bool cmos);
+  ~State();
 
   void reset_to_floating();
   void reset_to_zero();
-  void apply_changed(std::set<int> changed);
+  void apply_changed(int net);
+  void apply_changed(const std::vector<int> &changed);
+  void apply_changed(const std::set<int> &changed);
+
+  // Force a net to a level, S_FLOAT to release it, and propagate
+  void force(int net, int level);
+
+  void revert(const std::vector<change> &changes);
+
+  // Save the levels and forced nets to a file, and restore them
+  bool save(const char *fname) const;
+  bool load(const char *fname);
+
+private:
+  // Worklist scratch, kept between calls to avoid reallocating
+  std::vector<uint64_t> queued;
+  std::vector<int> changed_nets, influenced_nets;
+
+  // Levelized engine scratch: levels being computed, the wave nets
+  // grouped by component and the start of each group, the wave nets
+  // flagged, the groups to redo and the nets they hold
+  std::vector<int> next_power, next_dist;
+  std::vector<int> wave_nets, wave_index, ccc_slot;
+  std::vector<uint64_t> in_wave;
+  std::vector<char> slot_redo;
+  std::vector<int> redo_nets;
+
+  struct wave_pool;
+  wave_pool *pool;
+
+  void record(int net) {
+    if(journaling) {
+      change c = { net, power[net], power_dist[net], forced_power[net] };
+      journal.push_back(c);
+    }
+  }
+
+  // Cycle detection: hash of the levels relative to the start of the
+  // propagation, iteration at which each (levels, changed nets) hash
+  // was seen, and the nets changed by each iteration
+  uint64_t level_hash;
+  std::unordered_map<uint64_t, int> seen_states;
+  std::vector<int> wave_log, wave_log_index;
+
+  static uint64_t mix(uint64_t k) {
+    k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+    return k ^ (k >> 31);
+  }
+
+  static uint64_t level_key(int net, int power, int dist) {
+    return mix((uint64_t(net) << 32) ^ (uint64_t(power) << 24) ^ uint64_t(dist));
+  }
+
+  void set_level(int net, int p, int d) {
+    record(net);
+    level_hash ^= level_key(net, power[net], power_dist[net]) ^ level_key(net, p, d);
+    power[net] = p;
+    power_dist[net] = d;
+  }
+
+  bool in_cycle(int net) const {
+    return !cycle_nets.empty() && std::binary_search(cycle_nets.begin(), cycle_nets.end(), net);
+  }
+
+  void build_components();
+  void start_cycle_detection();
+  bool find_cycle(int count);
+  void queue(int net);
+  void queue_influenced();
+  bool resolve(int net, int ccc, bool redo, int &new_state, int &new_dist, bool &cross, bool verbose) const;
+  void apply_levelized();
+  void resolve_component(int slot, bool verbose);
 };
 
 #endif
@@ -0,0 +1,69 @@
+#ifndef CIRCUIT_DB_H
+#define CIRCUIT_DB_H
+
+// Binary, memory-mappable version of the circuit description written
+// by generate-circuit next to the text dump.  The file is a header
+// followed by sections, each one a flat array of records or ints
+// aligned on 8 bytes.  The records are the in-memory cinfo/tinfo
+// structures, so a loaded file is used in place without any parsing.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+struct cinfo {
+  char type;
+  int net, netp, trans;
+  int x0, y0, x1, y1, surface;
+};
+
+struct tinfo {
+  int circ, t1, t2, gate, x, y;
+  double f;
+};
+
+static_assert(sizeof(cinfo) == 36, "cinfo layout changed, bump CDB_VERSION");
+static_assert(sizeof(tinfo) == 32, "tinfo layout changed, bump CDB_VERSION");
+
+enum {
+  CDB_CIRCS,              // cinfo[ncircs]
+  CDB_NEIGHBORS_INDEX,    // int[ncircs+1], offsets in CDB_NEIGHBORS
+  CDB_NEIGHBORS,          // int[], neighbor circuit ids
+  CDB_NET_CIRCS_INDEX,    // int[nnets+1], offsets in CDB_NET_CIRCS
+  CDB_NET_CIRCS,          // int[], circuit ids per net
+  CDB_TRANS,              // tinfo[ntrans]
+  CDB_GATE_TRANS_INDEX,   // int[nnets+1], offsets in CDB_GATE_TRANS
+  CDB_GATE_TRANS,         // int[], transistors gated by each net
+  CDB_TERM_TRANS_INDEX,   // int[nnets+1], offsets in CDB_TERM_TRANS
+  CDB_TERM_TRANS,         // int[], transistors with a terminal on each net
+  CDB_SECTIONS
+};
+
+enum {
+  CDB_VERSION = 2,
+  CDB_ENDIAN = 0x01020304
+};
+
+extern const char cdb_magic[8];
+
+struct circuit_db_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  int32_t sx, sy, nl;
+  int32_t ncircs, nnets, ntrans;
+  int32_t pad;
+  struct {
+    uint64_t offset;
+    uint64_t count;
+  } sections[CDB_SECTIONS];
+};
+
+// Build the net to transistor offset/index arrays.  A transistor
+// appears once per terminal on the net, in transistor order.
+void cdb_build_trans_index(const tinfo *trans, int ntrans, int nnets,
+			   std::vector<int> &gate_index, std::vector<int> &gate_list,
+			   std::vector<int> &term_index, std::vector<int> &term_list);
+
+#endif
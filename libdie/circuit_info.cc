@@ -1,18 +1,121 @@
+#define _FILE_OFFSET_BITS 64
 #undef _FORTIFY_SOURCE
 
 #include "circuit_info.h"
+#include "circuit_db.h"
+#include "images.h"
 #include "reader.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
 
+#include <string>
+
+const char cdb_magic[8] = "CIRCDB\n";
+
+static const uint64_t cdb_element_size[CDB_SECTIONS] = {
+  sizeof(cinfo), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(tinfo),
+  sizeof(int), sizeof(int), sizeof(int), sizeof(int)
+};
+
 circuit_info::circuit_info(const char *fname)
+{
+  map_adr = NULL;
+  map_size = 0;
+
+  // Either the database itself was given, or look for one next to
+  // the text dump and use it when it is not older than the text.
+  if(load_db(fname, false))
+    return;
+
+  std::string db = std::string(fname) + ".db";
+  struct stat st_text, st_db;
+  if(!stat(db.c_str(), &st_db) && !stat(fname, &st_text)) {
+    if(st_db.st_mtime >= st_text.st_mtime) {
+      if(load_db(db.c_str(), true))
+	return;
+    } else
+      fprintf(stderr, "%s is older than %s, ignoring it\n", db.c_str(), fname);
+  }
+
+  load_text(fname);
+}
+
+circuit_info::~circuit_info()
+{
+  if(map_adr)
+    #ifdef _WIN32
+      UnmapViewOfFile(map_adr);
+    #else
+      munmap(map_adr, map_size);
+    #endif
+}
+
+bool circuit_info::load_db(const char *fname, bool accept_not_here)
+{
+  map_file_ro(fname, map_adr, map_size, accept_not_here);
+  if(!map_adr)
+    return false;
+
+  const circuit_db_header *h = (const circuit_db_header *)map_adr;
+  if(map_size < int64_t(sizeof(circuit_db_header)) || memcmp(h->magic, cdb_magic, 8))
+    goto not_db;
+
+  if(h->version != CDB_VERSION || h->endian != CDB_ENDIAN) {
+    fprintf(stderr, "%s: unsupported circuit database version %d, ignoring it\n", fname, h->version);
+    goto not_db;
+  }
+
+  for(int i=0; i != CDB_SECTIONS; i++)
+    if(h->sections[i].offset > uint64_t(map_size) || h->sections[i].count*cdb_element_size[i] > uint64_t(map_size) - h->sections[i].offset) {
+      fprintf(stderr, "%s: truncated circuit database, ignoring it\n", fname);
+      goto not_db;
+    }
+
+  sx = h->sx;
+  sy = h->sy;
+  nl = h->nl;
+  nnets = h->nnets;
+
+  circs.map((const cinfo *)(map_adr + h->sections[CDB_CIRCS].offset), h->sections[CDB_CIRCS].count);
+  circ_neighbors_index.map((const int *)(map_adr + h->sections[CDB_NEIGHBORS_INDEX].offset), h->sections[CDB_NEIGHBORS_INDEX].count);
+  circ_neighbors.map((const int *)(map_adr + h->sections[CDB_NEIGHBORS].offset), h->sections[CDB_NEIGHBORS].count);
+  net_circs_index.map((const int *)(map_adr + h->sections[CDB_NET_CIRCS_INDEX].offset), h->sections[CDB_NET_CIRCS_INDEX].count);
+  net_circs.map((const int *)(map_adr + h->sections[CDB_NET_CIRCS].offset), h->sections[CDB_NET_CIRCS].count);
+  trans.map((const tinfo *)(map_adr + h->sections[CDB_TRANS].offset), h->sections[CDB_TRANS].count);
+  gate_trans_index.map((const int *)(map_adr + h->sections[CDB_GATE_TRANS_INDEX].offset), h->sections[CDB_GATE_TRANS_INDEX].count);
+  gate_trans_list.map((const int *)(map_adr + h->sections[CDB_GATE_TRANS].offset), h->sections[CDB_GATE_TRANS].count);
+  term_trans_index.map((const int *)(map_adr + h->sections[CDB_TERM_TRANS_INDEX].offset), h->sections[CDB_TERM_TRANS_INDEX].count);
+  term_trans_list.map((const int *)(map_adr + h->sections[CDB_TERM_TRANS].offset), h->sections[CDB_TERM_TRANS].count);
+  assert(int(circs.size()) == h->ncircs && int(trans.size()) == h->ntrans);
+  assert(int(circ_neighbors_index.size()) == h->ncircs+1 && int(net_circs_index.size()) == h->nnets+1);
+  assert(int(gate_trans_index.size()) == h->nnets+1 && int(term_trans_index.size()) == h->nnets+1);
+
+  return true;
+
+ not_db:
+  #ifdef _WIN32
+    UnmapViewOfFile(map_adr);
+  #else
+    munmap(map_adr, map_size);
+  #endif
+  map_adr = NULL;
+  map_size = 0;
+  return false;
+}
+
+void circuit_info::load_text(const char *fname)
 {
   reader rd(fname);
 
@@ -21,14 +124,19 @@ circuit_info::circuit_info(const char *fname)
   nl = rd.gi();
   rd.nl();
 
+  std::vector<cinfo> vcircs;
+  std::vector<tinfo> vtrans;
+  std::vector<int> vindex, vlist;
+
   int ne = rd.gi();
   rd.nl();
-  circs.resize(ne);
+  vcircs.resize(ne);
+  vindex.resize(ne+1);
   for(int i=0; i != ne; i++) {
     int id = rd.gi();
     (void)id;
     assert(id == i);
-    cinfo &ci = circs[i];
+    cinfo &ci = vcircs[i];
     ci.type = rd.gw()[0];
     ci.net = rd.gi();
     ci.netp = rd.gi();
@@ -38,34 +146,42 @@ circuit_info::circuit_info(const char *fname)
     ci.x1 = rd.gi();
     ci.y1 = rd.gi();
     ci.surface = rd.gi();
+    vindex[i] = vlist.size();
     while(!rd.eol())
-      ci.neighbors.push_back(strtol(rd.gw()+1, 0, 10));
+      vlist.push_back(strtol(rd.gw()+1, 0, 10));
     rd.nl();
   }
+  vindex[ne] = vlist.size();
+  circ_neighbors_index.own(vindex);
+  circ_neighbors.own(vlist);
 
   ne = rd.gi();
   rd.nl();
-  nets.resize(ne);
+  nnets = ne;
+  vindex.resize(ne+1);
   for(int i=0; i != ne; i++) {
     int id = rd.gi();
     (void)id;
     assert(id == i);
-    ninfo &ni = nets[i];
+    vindex[i] = vlist.size();
     while(!rd.eol())
-      ni.circ.push_back(rd.gi());
+      vlist.push_back(rd.gi());
     rd.nl();
   }
+  vindex[ne] = vlist.size();
+  net_circs_index.own(vindex);
+  net_circs.own(vlist);
 
   ne = rd.gi();
   rd.nl();
-  trans.resize(ne);
+  vtrans.resize(ne);
   for(int i=0; i != ne; i++) {
     int id = rd.gi();
     (void)id;
     assert(id == i);
-    tinfo &ti = trans[i];
+    tinfo &ti = vtrans[i];
     ti.circ = rd.gi();
-    circs[ti.circ].trans = i;
+    vcircs[ti.circ].trans = i;
     ti.x = rd.gi();
     ti.y = rd.gi();
     ti.t1 = rd.gi();
@@ -73,8 +189,49 @@ circuit_info::circuit_info(const char *fname)
     ti.t2 = rd.gi();
     ti.f = rd.gd();
     rd.nl();
-    gate_to_trans[ti.gate].push_back(i);
-    term_to_trans[ti.t1].push_back(i);
-    term_to_trans[ti.t2].push_back(i);
+  }
+  circs.own(vcircs);
+
+  std::vector<int> gindex, glist, tindex, tlist;
+  cdb_build_trans_index(vtrans.data(), vtrans.size(), nnets, gindex, glist, tindex, tlist);
+  gate_trans_index.own(gindex);
+  gate_trans_list.own(glist);
+  term_trans_index.own(tindex);
+  term_trans_list.own(tlist);
+  trans.own(vtrans);
+}
+
+void cdb_build_trans_index(const tinfo *trans, int ntrans, int nnets,
+			   std::vector<int> &gate_index, std::vector<int> &gate_list,
+			   std::vector<int> &term_index, std::vector<int> &term_list)
+{
+  gate_index.assign(nnets+1, 0);
+  term_index.assign(nnets+1, 0);
+  for(int i=0; i != ntrans; i++) {
+    const tinfo &ti = trans[i];
+    if(ti.gate >= 0)
+      gate_index[ti.gate+1]++;
+    if(ti.t1 >= 0)
+      term_index[ti.t1+1]++;
+    if(ti.t2 >= 0)
+      term_index[ti.t2+1]++;
+  }
+  for(int i=0; i != nnets; i++) {
+    gate_index[i+1] += gate_index[i];
+    term_index[i+1] += term_index[i];
+  }
+
+  gate_list.resize(gate_index[nnets]);
+  term_list.resize(term_index[nnets]);
+  std::vector<int> gpos(gate_index.begin(), gate_index.end()-1);
+  std::vector<int> tpos(term_index.begin(), term_index.end()-1);
+  for(int i=0; i != ntrans; i++) {
+    const tinfo &ti = trans[i];
+    if(ti.gate >= 0)
+      gate_list[gpos[ti.gate]++] = i;
+    if(ti.t1 >= 0)
+      term_list[tpos[ti.t1]++] = i;
+    if(ti.t2 >= 0)
+      term_list[tpos[ti.t2]++] = i;
   }
 }
@@ -1,36 +1,97 @@
 #ifndef CIRCUIT_INFO_H
 #define CIRCUIT_INFO_H
 
-#include <map>
+#include "circuit_db.h"
+
 #include <vector>
 
-struct cinfo {
-  char type;
-  int net, netp, trans;
-  int x0, y0, x1, y1, surface;
-  std::vector<int> neighbors;
-};
+// Read-only array that either owns its storage (text netlist) or
+// points inside a mapped circuit database.
+template<typename T> class db_array {
+public:
+  db_array() { ptr = nullptr; count = 0; }
+  db_array(const db_array &) = delete;
+  db_array &operator=(const db_array &) = delete;
+
+  const T &operator[](size_t i) const { return ptr[i]; }
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  const T *data() const { return ptr; }
+  const T *begin() const { return ptr; }
+  const T *end() const { return ptr + count; }
 
-struct ninfo {
-  std::vector<int> circ;
+  void own(std::vector<T> &v) {
+    store.swap(v);
+    ptr = store.data();
+    count = store.size();
+  }
+
+  void map(const T *p, size_t n) {
+    store.clear();
+    ptr = p;
+    count = n;
+  }
+
+private:
+  std::vector<T> store;
+  const T *ptr;
+  size_t count;
 };
 
-struct tinfo {
-  int circ, t1, t2, gate, x, y;
-  double f;
+struct db_range {
+  const int *b, *e;
+  const int *begin() const { return b; }
+  const int *end() const { return e; }
+  int size() const { return e - b; }
 };
 
 class circuit_info {
 public:
-  std::vector<cinfo> circs;
-  std::vector<ninfo> nets;
-  std::vector<tinfo> trans;
-  std::map<int, std::vector<int>> gate_to_trans;
-  std::map<int, std::vector<int>> term_to_trans;
+  db_array<cinfo> circs;
+  db_array<tinfo> trans;
+
+  // Compressed adjacency, the index arrays have one more entry than
+  // there are circuits/nets.
+  db_array<int> circ_neighbors_index, circ_neighbors;
+  db_array<int> net_circs_index, net_circs;
+  db_array<int> gate_trans_index, gate_trans_list;
+  db_array<int> term_trans_index, term_trans_list;
 
   int sx, sy, nl;
+  int nnets;
 
   circuit_info(const char *fname);
+  ~circuit_info();
+
+  db_range neighbors(int circ) const {
+    return csr(circ_neighbors_index, circ_neighbors, circ);
+  }
+
+  db_range net_circuits(int net) const {
+    return csr(net_circs_index, net_circs, net);
+  }
+
+  db_range gate_trans(int net) const {
+    return csr(gate_trans_index, gate_trans_list, net);
+  }
+
+  db_range term_trans(int net) const {
+    return csr(term_trans_index, term_trans_list, net);
+  }
+
+private:
+  unsigned char *map_adr;
+  int64_t map_size;
+
+  static db_range csr(const db_array<int> &index, const db_array<int> &list, int id) {
+    db_range r;
+    r.b = list.data() + index[id];
+    r.e = list.data() + index[id+1];
+    return r;
+  }
+
+  bool load_db(const char *fname, bool accept_not_here);
+  void load_text(const char *fname);
 };
 
 #endif
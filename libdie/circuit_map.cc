@@ -104,24 +104,94 @@ circuit_map::circuit_map(const char *fname, int _nl, int _sx, int _sy, bool crea
   sx = _sx;
   sy = _sy;
   nl = _nl;
-  unsigned char *map_adr;
+  tile_index = NULL;
+  tiles_x = 0;
+  last = -1;
+  stamp = 0;
   if(create) {
-    create_file_rw(fname, map_adr, long(nl)*4*sx*sy);
-    memset(map_adr, 0xff, long(nl)*sx*sy*4);
+    map_size = int64_t(nl)*4*sx*sy;
+    create_file_rw(fname, map_adr, map_size);
+    memset(map_adr, 0xff, map_size);
+    data = (int *)map_adr;
+    return;
+  }
 
-  } else {
-    int64_t size;
-    map_file_ro(fname, map_adr, size, false);
+  map_file_ro(fname, map_adr, map_size, false);
+  if(map_size < int64_t(sizeof(circuit_map_tiled_header)) || memcmp(map_adr, CIRCUIT_MAP_TILED_MAGIC, 8)) {
+    data = (int *)map_adr;
+    return;
   }
 
-  data = (int *)map_adr;
+  circuit_map_tiled_header h;
+  memcpy(&h, map_adr, sizeof(h));
+  if(h.sx != sx || h.sy != sy || h.nl != nl || h.tile != CIRCUIT_MAP_TILE) {
+    fprintf(stderr, "%s: tiled map is %dx%d with %d layers and %d pixel tiles, expected %dx%d with %d layers and %d pixel tiles\n",
+	    fname, h.sx, h.sy, h.nl, h.tile, sx, sy, nl, int(CIRCUIT_MAP_TILE));
+    exit(1);
+  }
+  tiles_x = (sx + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int tiles_y = (sy + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int64_t ntiles = int64_t(tiles_x)*tiles_y;
+  if(map_size < int64_t(sizeof(h) + 8*(ntiles+1))) {
+    fprintf(stderr, "%s: truncated tiled map\n", fname);
+    exit(1);
+  }
+  tile_index = (const uint64_t *)(map_adr + sizeof(h));
+  if(tile_index[ntiles] > uint64_t(map_size)) {
+    fprintf(stderr, "%s: truncated tiled map\n", fname);
+    exit(1);
+  }
+  data = NULL;
 }
 
 circuit_map::~circuit_map()
 {
   #ifdef _WIN32
-    UnmapViewOfFile(data);
+    UnmapViewOfFile(map_adr);
   #else
-    munmap(data, long(nl)*sx*sy*4);
+    munmap(map_adr, map_size);
   #endif
 }
+
+int circuit_map::tp(int l, int x, int y) const
+{
+  int tile = (y / CIRCUIT_MAP_TILE) * tiles_x + x / CIRCUIT_MAP_TILE;
+  const cached_tile &ct = last != -1 && cache[last].tile == tile ? cache[last] : load_tile(tile);
+  return ct.pix[l + nl*((x % CIRCUIT_MAP_TILE) + (y % CIRCUIT_MAP_TILE)*CIRCUIT_MAP_TILE)];
+}
+
+// Finds the tile in the cache or decodes it in place of the least
+// recently used one
+const circuit_map::cached_tile &circuit_map::load_tile(int tile) const
+{
+  stamp++;
+  for(unsigned int i=0; i != cache.size(); i++)
+    if(cache[i].tile == tile) {
+      cache[i].stamp = stamp;
+      last = i;
+      return cache[i];
+    }
+
+  int slot;
+  if(cache.size() < CACHED_TILES) {
+    slot = cache.size();
+    cache.resize(slot+1);
+    cache[slot].pix.resize(nl*CIRCUIT_MAP_TILE*CIRCUIT_MAP_TILE);
+  } else {
+    slot = 0;
+    for(unsigned int i=1; i != cache.size(); i++)
+      if(cache[i].stamp < cache[slot].stamp)
+	slot = i;
+  }
+  cached_tile &ct = cache[slot];
+  ct.tile = tile;
+  ct.stamp = stamp;
+  last = slot;
+
+  int tx = (tile % tiles_x) * CIRCUIT_MAP_TILE;
+  int ty = (tile / tiles_x) * CIRCUIT_MAP_TILE;
+  int tw = sx - tx < CIRCUIT_MAP_TILE ? sx - tx : CIRCUIT_MAP_TILE;
+  int th = sy - ty < CIRCUIT_MAP_TILE ? sy - ty : CIRCUIT_MAP_TILE;
+  circuit_map_tiled_decode(map_adr + tile_index[tile], map_adr + tile_index[tile+1], tile, nl, tw, th, ct.pix.data(), CIRCUIT_MAP_TILE);
+  return ct;
+}
@@ -1,6 +1,18 @@
 #ifndef CIRCUIT_MAP_H
 #define CIRCUIT_MAP_H
 
+#include "circuit_map_tiled.h"
+
+#include <stdint.h>
+#include <vector>
+
+// Circuit ids per layer and pixel, -1 for none.  The map file is
+// either the raw int array, layers interleaved, or the tiled format
+// of circuit_map_tiled.h, recognized by its header.  Tiled
+// maps are decoded a tile at a time as p() reaches them, the last
+// ones decoded being kept.  They are not safe to read from several
+// threads at once.
+
 class circuit_map {
 public:
   int *data;
@@ -9,6 +21,8 @@ public:
   int p(int l, int x, int y) const {
     if(x < 0 || x >= sx || y < 0 || y >= sy)
       return -1;
+    if(!data)
+      return tp(l, x, y);
     return data[l+nl*(x+y*sx)];
   }
 
@@ -18,6 +32,26 @@ public:
 
   circuit_map(const char *fname, int nl, int sx, int sy, bool create);
   ~circuit_map();
+
+private:
+  enum { CACHED_TILES = 16 };
+
+  struct cached_tile {
+    int tile;
+    uint64_t stamp;
+    std::vector<int> pix;
+  };
+
+  unsigned char *map_adr;
+  int64_t map_size;
+  const uint64_t *tile_index;
+  int tiles_x;
+  mutable std::vector<cached_tile> cache;
+  mutable int last;
+  mutable uint64_t stamp;
+
+  int tp(int l, int x, int y) const;
+  const cached_tile &load_tile(int tile) const;
 };
 
 #endif
@@ -0,0 +1,211 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "circuit_map_tiled.h"
+#include "images.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+#endif
+
+void circuit_map_tiled_decode(const unsigned char *src, const unsigned char *end, int tile, int nl, int tw, int th, int *dst, int64_t stride)
+{
+  for(int l=0; l != nl; l++) {
+    uint32_t nruns = 0;
+    if(src + 4 <= end)
+      memcpy(&nruns, src, 4);
+    src += 4;
+    const unsigned char *values = src;
+    const unsigned char *lengths = src + 4*int64_t(nruns);
+    src = lengths + 2*int64_t(nruns);
+    if(src > end) {
+      fprintf(stderr, "Corrupted tiled map in tile %d\n", tile);
+      exit(1);
+    }
+    int pos = 0;
+    for(uint32_t r=0; r != nruns; r++) {
+      int32_t v;
+      uint16_t n;
+      memcpy(&v, values + 4*r, 4);
+      memcpy(&n, lengths + 2*r, 2);
+      if(pos + n > tw*th) {
+	fprintf(stderr, "Corrupted tiled map in tile %d\n", tile);
+	exit(1);
+      }
+      for(int i=0; i != n; i++, pos++)
+	dst[l + nl*(pos % tw + (pos / tw)*stride)] = v;
+    }
+    if(pos != tw*th) {
+      fprintf(stderr, "Corrupted tiled map in tile %d\n", tile);
+      exit(1);
+    }
+  }
+}
+
+circuit_map_tiled_reader::circuit_map_tiled_reader()
+{
+  map_adr = NULL;
+  map_size = 0;
+  index = NULL;
+  nl = sx = sy = tiles_x = 0;
+}
+
+circuit_map_tiled_reader::~circuit_map_tiled_reader()
+{
+  if(!map_adr)
+    return;
+  #ifdef _WIN32
+    UnmapViewOfFile(map_adr);
+  #else
+    munmap(map_adr, map_size);
+  #endif
+}
+
+bool circuit_map_tiled_reader::open(const char *fname, int _nl, int _sx, int _sy)
+{
+  map_file_ro(fname, map_adr, map_size, true);
+  if(!map_adr)
+    return false;
+  circuit_map_tiled_header h;
+  if(map_size < int64_t(sizeof(h)))
+    return false;
+  memcpy(&h, map_adr, sizeof(h));
+  if(memcmp(h.magic, CIRCUIT_MAP_TILED_MAGIC, 8) || h.sx != _sx || h.sy != _sy || h.nl != _nl || h.tile != CIRCUIT_MAP_TILE)
+    return false;
+  nl = _nl;
+  sx = _sx;
+  sy = _sy;
+  tiles_x = (sx + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int tiles_y = (sy + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int64_t ntiles = int64_t(tiles_x)*tiles_y;
+  if(map_size < int64_t(sizeof(h) + 8*(ntiles+1)))
+    return false;
+  index = (const uint64_t *)(map_adr + sizeof(h));
+  return index[ntiles] <= uint64_t(map_size);
+}
+
+void circuit_map_tiled_reader::read_band(int band, int *rows) const
+{
+  int ty = band * CIRCUIT_MAP_TILE;
+  int th = sy - ty < CIRCUIT_MAP_TILE ? sy - ty : CIRCUIT_MAP_TILE;
+  for(int tile_x = 0; tile_x != tiles_x; tile_x++) {
+    int tile = band*tiles_x + tile_x;
+    int tx = tile_x * CIRCUIT_MAP_TILE;
+    int tw = sx - tx < CIRCUIT_MAP_TILE ? sx - tx : CIRCUIT_MAP_TILE;
+    circuit_map_tiled_decode(map_adr + index[tile], map_adr + index[tile+1], tile, nl, tw, th, rows + nl*tx, sx);
+  }
+}
+
+const unsigned char *circuit_map_tiled_reader::trailer(int64_t &size) const
+{
+  int64_t ntiles = int64_t(tiles_x)*((sy + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE);
+  size = map_size - index[ntiles];
+  return map_adr + index[ntiles];
+}
+
+circuit_map_tiled_writer::circuit_map_tiled_writer(const char *_fname, int _nl, int _sx, int _sy)
+{
+  fname = _fname;
+  nl = _nl;
+  sx = _sx;
+  sy = _sy;
+  tiles_x = (sx + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int tiles_y = (sy + CIRCUIT_MAP_TILE - 1) / CIRCUIT_MAP_TILE;
+  int64_t ntiles = int64_t(tiles_x)*tiles_y;
+  band = 0;
+
+  char msg[4096];
+  sprintf(msg, "Error opening %s for writing", _fname);
+  fd = fopen(_fname, "wb");
+  if(!fd) {
+    perror(msg);
+    exit(1);
+  }
+
+  circuit_map_tiled_header h;
+  memcpy(h.magic, CIRCUIT_MAP_TILED_MAGIC, 8);
+  h.sx = sx;
+  h.sy = sy;
+  h.nl = nl;
+  h.tile = CIRCUIT_MAP_TILE;
+  fwrite(&h, sizeof(h), 1, fd);
+  index.resize(ntiles+1);
+  fwrite(index.data(), 8, ntiles+1, fd);
+  pos = sizeof(h) + 8*(ntiles+1);
+}
+
+circuit_map_tiled_writer::~circuit_map_tiled_writer()
+{
+  if(fd)
+    close();
+}
+
+void circuit_map_tiled_writer::add_band(const int *rows)
+{
+  int ty = band * CIRCUIT_MAP_TILE;
+  int th = sy - ty < CIRCUIT_MAP_TILE ? sy - ty : CIRCUIT_MAP_TILE;
+  for(int tile_x = 0; tile_x != tiles_x; tile_x++) {
+    index[int64_t(band)*tiles_x + tile_x] = pos;
+    int tx = tile_x * CIRCUIT_MAP_TILE;
+    int tw = sx - tx < CIRCUIT_MAP_TILE ? sx - tx : CIRCUIT_MAP_TILE;
+    for(int l=0; l != nl; l++) {
+      values.clear();
+      lengths.clear();
+      for(int y=0; y != th; y++) {
+	const int *d = rows + l + int64_t(nl)*(int64_t(y)*sx + tx);
+	for(int x=0; x != tw; x++, d += nl)
+	  if(!values.empty() && values.back() == *d)
+	    lengths.back()++;
+	  else {
+	    values.push_back(*d);
+	    lengths.push_back(1);
+	  }
+      }
+      uint32_t nruns = values.size();
+      fwrite(&nruns, 4, 1, fd);
+      fwrite(values.data(), 4, nruns, fd);
+      fwrite(lengths.data(), 2, nruns, fd);
+      pos += 4 + 6*uint64_t(nruns);
+    }
+  }
+  band++;
+}
+
+void circuit_map_tiled_writer::copy_band(const circuit_map_tiled_reader &src)
+{
+  int64_t t0 = int64_t(band)*tiles_x;
+  uint64_t start = src.index[t0];
+  uint64_t size = src.index[t0 + tiles_x] - start;
+  for(int tile_x = 0; tile_x != tiles_x; tile_x++)
+    index[t0 + tile_x] = pos + src.index[t0 + tile_x] - start;
+  fwrite(src.map_adr + start, 1, size, fd);
+  pos += size;
+  band++;
+}
+
+void circuit_map_tiled_writer::close()
+{
+  index.back() = pos;
+  fseeko(fd, sizeof(circuit_map_tiled_header), SEEK_SET);
+  fwrite(index.data(), 8, index.size(), fd);
+  bool err = ferror(fd);
+  if(fclose(fd) || err) {
+    char msg[4096];
+    sprintf(msg, "Error writing %s", fname.c_str());
+    perror(msg);
+    exit(1);
+  }
+  fd = NULL;
+}
+
+void circuit_map_save_tiled(const char *fname, const int *data, int nl, int sx, int sy)
+{
+  circuit_map_tiled_writer w(fname, nl, sx, sy);
+  for(int y=0; y < sy; y += CIRCUIT_MAP_TILE)
+    w.add_band(data + int64_t(nl)*sx*y);
+  w.close();
+}
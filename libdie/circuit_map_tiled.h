@@ -0,0 +1,87 @@
+#ifndef CIRCUIT_MAP_TILED_H
+#define CIRCUIT_MAP_TILED_H
+
+// Compressed version of the circuit map file.  The file is a header
+// (magic, sx, sy, nl, tile size), the file offsets of the tiles in
+// raster order plus the end of the last one, then the tiles.  Each
+// tile of CIRCUIT_MAP_TILE pixels square, less on the right and bottom
+// edges, is stored layer by layer as a run count, the run ids and the
+// 16-bit run lengths, the runs following the tile in raster order.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+enum { CIRCUIT_MAP_TILE = 64 };
+
+#define CIRCUIT_MAP_TILED_MAGIC "DIEMAPT1"
+
+struct circuit_map_tiled_header {
+  char magic[8];
+  int32_t sx, sy, nl, tile;
+};
+
+// Decode the tile at src, which ends at end, tw by th pixels, into
+// dst, where pixel x, y of layer l goes to l+nl*(x+y*stride).  Exits
+// on a corrupted tile.
+void circuit_map_tiled_decode(const unsigned char *src, const unsigned char *end, int tile, int nl, int tw, int th, int *dst, int64_t stride);
+
+// Reads the file a row of tiles at a time
+class circuit_map_tiled_reader {
+public:
+  int nl, sx, sy;
+
+  circuit_map_tiled_reader();
+  ~circuit_map_tiled_reader();
+
+  // False when the file is missing or not a tiled map of that size
+  bool open(const char *fname, int nl, int sx, int sy);
+
+  // Decode the given row of tiles into rows, layers interleaved as in
+  // the raw map
+  void read_band(int band, int *rows) const;
+
+  // What the file holds after the tiles, size bytes of it
+  const unsigned char *trailer(int64_t &size) const;
+
+private:
+  friend class circuit_map_tiled_writer;
+
+  unsigned char *map_adr;
+  int64_t map_size;
+  const uint64_t *index;
+  int tiles_x;
+};
+
+// Writes the file a row of tiles at a time, so that the map can be
+// handed over band by band and never needs to be whole in memory.
+class circuit_map_tiled_writer {
+public:
+  circuit_map_tiled_writer(const char *fname, int nl, int sx, int sy);
+  ~circuit_map_tiled_writer();
+
+  // Encode the next CIRCUIT_MAP_TILE rows, fewer for the last band,
+  // layers interleaved as in the raw map
+  void add_band(const int *rows);
+
+  // Copy the same row of tiles from a map of the same size, as is
+  void copy_band(const circuit_map_tiled_reader &src);
+
+  // Write the tile index and close the file
+  void close();
+
+private:
+  FILE *fd;
+  std::string fname;
+  int nl, sx, sy, tiles_x, band;
+  uint64_t pos;
+  std::vector<uint64_t> index;
+  std::vector<int32_t> values;
+  std::vector<uint16_t> lengths;
+};
+
+void circuit_map_save_tiled(const char *fname, const int *data, int nl, int sx, int sy);
+
+#endif
@@ -100,6 +100,40 @@ void create_file_rw(const char *fname, unsigned char *&data, int64_t size)
   #endif
 }
 
+void map_file_rw(const char *fname, unsigned char *&data, int64_t &size)
+{
+  char msg[4096];
+  #ifdef _WIN32
+    HANDLE fd = CreateFile(fname, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(fd == INVALID_HANDLE_VALUE) {
+      FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), msg, 4096, NULL);
+      fprintf(stderr, "CreateFile failed. Windows error code: %s", msg);
+      exit(1);
+    }
+    size = GetFileSize(fd, NULL);
+    HANDLE map = CreateFileMapping(fd, NULL, PAGE_READWRITE, 0, 0, fname);
+    data = (unsigned char *) MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if(data == NULL) {
+      FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), msg, 4096, NULL);
+      fprintf(stderr, "MapViewOfFile failed. Windows error code: %s", msg);
+      exit(1);
+    }
+    CloseHandle(fd);
+  #else
+    sprintf(msg, "Error opening %s for writing", fname);
+    int fd = open(fname, O_RDWR);
+    if(fd < 0) {
+      perror(msg);
+      exit(1);
+    }
+    size = lseek(fd, 0, SEEK_END);
+    data = (unsigned char *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  #endif
+}
+
 void create_file_rw_header(const char *fname, unsigned char *&map_adr, unsigned char *&data, int64_t &size, int dsize, const char *header)
 {
   int hsize = strlen(header);
@@ -161,6 +195,23 @@ pbm::pbm(int _sx, int _sy)
   size = 0;
 }
 
+void pbm::release_rows(int y0, int y1) const
+{
+  #ifndef _WIN32
+    if(!map_adr)
+      return;
+    if(y1 > sy)
+      y1 = sy;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = uintptr_t(img + int64_t(y0)*sxb);
+    uintptr_t end = uintptr_t(img + int64_t(y1)*sxb);
+    start = (start + page - 1) & ~(page - 1);
+    end = end & ~(page - 1);
+    if(start < end)
+      madvise((void *)start, end - start, MADV_DONTNEED);
+  #endif
+}
+
 pbm::~pbm()
 {
   if(map_adr)
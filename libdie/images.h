@@ -2,6 +2,7 @@
 #define IMAGES_H
 
 #include <stdint.h>
+#include <string.h>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 
@@ -62,6 +63,83 @@ struct pbm {
     else
       img[y*sxb + (x >> 3)] |= 0x80 >> (x & 7);
   }
+
+  // Word access, 64 pixels at a time.  Word i of a row holds pixels
+  // 64*i to 64*i+63, the first one in the most significant bit, a bit
+  // being set when p() is.  Pixels past sx read as 0.
+  int nw() const {
+    return (sx + 63) >> 6;
+  }
+
+  uint64_t w(int i, int y) const {
+    const unsigned char *b = img + int64_t(y)*sxb + 8*i;
+    int n = sxb - 8*i;
+    uint64_t v;
+    if(n >= 8) {
+      memcpy(&v, b, 8);
+      v = __builtin_bswap64(v);
+    } else {
+      v = 0;
+      for(int j=0; j != 8; j++)
+	v = (v << 8) | (j < n ? b[j] : 0xff);
+    }
+    v = ~v;
+    int valid = sx - 64*i;
+    if(valid < 64)
+      v &= ~(~uint64_t(0) >> valid);
+    return v;
+  }
+
+  void row(int y, uint64_t *r) const {
+    int n = nw();
+    for(int i=0; i != n; i++)
+      r[i] = w(i, y);
+  }
+
+  // Finds the first run of set pixels starting at or after x0 in a
+  // row of n words, returns it in x0-x1 or false if there is none
+  static bool next_run(const uint64_t *r, int n, int &x0, int &x1) {
+    int i = x0 >> 6;
+    if(i >= n)
+      return false;
+    uint64_t v = r[i] & (~uint64_t(0) >> (x0 & 63));
+    while(!v) {
+      if(++i == n)
+	return false;
+      v = r[i];
+    }
+    x0 = 64*i + __builtin_clzll(v);
+    uint64_t z = ~r[i] & (~uint64_t(0) >> (x0 & 63));
+    while(!z) {
+      if(++i == n) {
+	x1 = 64*n - 1;
+	return true;
+      }
+      z = ~r[i];
+    }
+    x1 = 64*i + __builtin_clzll(z) - 1;
+    return true;
+  }
+
+  static void row_and(uint64_t *d, const uint64_t *s, int n) {
+    for(int i=0; i != n; i++)
+      d[i] &= s[i];
+  }
+
+  static void row_or(uint64_t *d, const uint64_t *s, int n) {
+    for(int i=0; i != n; i++)
+      d[i] |= s[i];
+  }
+
+  static void row_andnot(uint64_t *d, const uint64_t *s, int n) {
+    for(int i=0; i != n; i++)
+      d[i] &= ~s[i];
+  }
+
+  // Drop rows y0 to y1-1 of a mapped image from memory, the file keeps
+  // them.  Images built in memory are left alone.
+  void release_rows(int y0, int y1) const;
+
   pbm(const char *fname);
   pbm(const char *fname, int sx, int sy, bool &created);
   pbm(int sx, int sy);
@@ -70,6 +148,7 @@ struct pbm {
 
 void map_file_ro(const char *fname, unsigned char *&data, int64_t &size, bool accept_not_here);
 void create_file_rw(const char *fname, unsigned char *&data, int64_t size);
+void map_file_rw(const char *fname, unsigned char *&data, int64_t &size);
 void create_file_rw_header(const char *fname, unsigned char *&map_adr, unsigned char *&data, int64_t &size, int dsize, const char *header);
 
 template<typename T, typename B> void load(T *&img, const char *fname, const B *base, boost::function1<void, T *> generator)
@@ -41,7 +41,7 @@ net_info::net_info(const char *fname, const circuit_map &cmap, const circuit_inf
   #endif
   close(fd);
 
-  names.resize(info.nets.size());
+  names.resize(info.nnets);
   pos = data;
   has_nl = false;
 
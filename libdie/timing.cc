@@ -3,20 +3,73 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+static double wall_time()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Covers all the threads of the process
+static double cpu_time()
+{
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void memory_usage(long &peak_rss_kb, long &minor_faults, long &major_faults)
+{
+#ifndef _WIN32
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  peak_rss_kb = ru.ru_maxrss;
+  minor_faults = ru.ru_minflt;
+  major_faults = ru.ru_majflt;
+#else
+  peak_rss_kb = minor_faults = major_faults = 0;
+#endif
+}
+
+time_info::time_info()
+{
+  start_time = 0;
+  lsec = 0;
+  running = false;
+}
 
 void time_info::start(const char *msg)
 {
   fprintf(stderr, "%s\n", msg);
-  gettimeofday(&start_time, NULL);
+  stage(msg);
+}
+
+void time_info::stage(const char *name)
+{
+  finish();
+  stage_info si;
+  si.name = name;
+  si.wall = si.cpu = 0;
+  si.items = si.peak_rss_kb = si.minor_faults = si.major_faults = 0;
+  stages.push_back(si);
+  long peak;
+  memory_usage(peak, start_minor_faults, start_major_faults);
+  start_cpu = cpu_time();
+  start_time = wall_time();
   lsec = 0;
+  running = true;
 }
 
 void time_info::tick(int pos, int max)
 {
   double ratio = double(pos+1)/double(max);
-  timeval ctime;
-  gettimeofday(&ctime, NULL);
-  int ms = (ctime.tv_sec - start_time.tv_sec) * 1000 + (ctime.tv_sec - start_time.tv_sec) / 1000;
+  int ms = int((wall_time() - start_time) * 1000);
   int rt = pos+1 == max ? ms : ms/ratio*(1-ratio);
   int rts = rt/1000;
   if(rts != lsec || pos+1 == max) {
@@ -24,3 +77,71 @@ void time_info::tick(int pos, int max)
     fprintf(stderr, " %3d%% %6d:%02d%c", int(100*ratio+0.5), rts / 60, rts % 60, pos+1 == max ? '\n' : '\r');
   }
 }
+
+void time_info::count(long items)
+{
+  if(running)
+    stages.back().items = items;
+}
+
+void time_info::finish()
+{
+  if(!running)
+    return;
+  stage_info &si = stages.back();
+  si.wall = wall_time() - start_time;
+  si.cpu = cpu_time() - start_cpu;
+  memory_usage(si.peak_rss_kb, si.minor_faults, si.major_faults);
+  si.minor_faults -= start_minor_faults;
+  si.major_faults -= start_major_faults;
+  running = false;
+}
+
+static void json_string(FILE *fd, const std::string &s)
+{
+  fputc('"', fd);
+  for(char c : s) {
+    if(c == '"' || c == '\\')
+      fprintf(fd, "\\%c", c);
+    else if((unsigned char)c < 0x20)
+      fprintf(fd, "\\u%04x", c);
+    else
+      fputc(c, fd);
+  }
+  fputc('"', fd);
+}
+
+bool time_info::report(const char *fname, const char *program) const
+{
+  FILE *fd = fopen(fname, "w");
+  if(!fd) {
+    perror(fname);
+    return false;
+  }
+
+  double wall = 0, cpu = 0;
+  long peak = 0;
+  for(const stage_info &si : stages) {
+    wall += si.wall;
+    cpu += si.cpu;
+    if(peak < si.peak_rss_kb)
+      peak = si.peak_rss_kb;
+  }
+
+  fprintf(fd, "{\"program\":");
+  json_string(fd, program);
+  fprintf(fd, ",\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,\"peak_rss_kb\":%ld,\"stages\":[", wall, cpu, peak);
+  for(unsigned int i=0; i != stages.size(); i++) {
+    const stage_info &si = stages[i];
+    fprintf(fd, "%s\n {\"stage\":", i ? "," : "");
+    json_string(fd, si.name);
+    fprintf(fd, ",\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,\"items\":%ld,\"peak_rss_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld}",
+	    si.wall, si.cpu, si.items, si.peak_rss_kb, si.minor_faults, si.major_faults);
+  }
+  fprintf(fd, "\n]}\n");
+  if(fclose(fd)) {
+    perror(fname);
+    return false;
+  }
+  return true;
+}
@@ -1,14 +1,39 @@
 #ifndef TIMING_H
 #define TIMING_H
 
-#include <sys/time.h>
+#include <string>
+#include <vector>
+
+// Progress display and per-stage profile.  A stage runs from its
+// start to the start of the next one or to finish().  start() names
+// the stage on the error output, stage() opens one silently.
 
 struct time_info {
-  timeval start_time;
+  struct stage_info {
+    std::string name;
+    double wall, cpu;
+    long items, peak_rss_kb, minor_faults, major_faults;
+  };
+
+  std::vector<stage_info> stages;
+  double start_time;
   int lsec;
 
+  time_info();
+
   void start(const char *msg);
+  void stage(const char *name);
   void tick(int pos, int max);
+  void count(long items);
+  void finish();
+
+  // Writes the stages as a json object, false on error
+  bool report(const char *fname, const char *program) const;
+
+private:
+  bool running;
+  double start_cpu;
+  long start_minor_faults, start_major_faults;
 };
 
 #endif
@@ -3,6 +3,8 @@
 #include "globals.h"
 #include "pad_info.h"
 
+#include <timing.h>
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -14,7 +16,6 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <zlib.h>
-#include <sys/time.h>
 
 #ifdef _WIN32
   #include <windows.h>
@@ -35,7 +36,7 @@ extern "C" {
 
 #include <fontconfig/fontconfig.h>
 
-const char *opt_text, *opt_svg, *opt_geojson, *opt_tiles;
+const char *opt_text, *opt_svg, *opt_geojson, *opt_tiles, *opt_profile;
 
 double ratio;
 int sy1;
@@ -47,11 +48,6 @@ enum {
   PATCH_SY = 512
 };
 
-struct time_info {
-  timeval start_time;
-  int lsec;
-};
-
 struct cglyph {
   int sx, sy, dx, dy, left, top;
   unsigned char *image;
@@ -182,27 +178,6 @@ static void freetype_render(const char *str, double size, double rot, int &width
   }
 }
 
-void start(time_info &tinfo, const char *msg)
-{
-  fprintf(stderr, "%s\n", msg);
-  gettimeofday(&tinfo.start_time, NULL);
-  tinfo.lsec = 0;
-}
-
-void tick(time_info &tinfo, int pos, int max)
-{
-  double ratio = double(pos+1)/double(max);
-  timeval ctime;
-  gettimeofday(&ctime, NULL);
-  int ms = (ctime.tv_sec - tinfo.start_time.tv_sec) * 1000 + (ctime.tv_sec - tinfo.start_time.tv_sec) / 1000;
-  int rt = pos+1 == max ? ms : ms/ratio*(1-ratio);
-  int rts = rt/1000;
-  if(rts != tinfo.lsec || pos+1 == max) {
-    tinfo.lsec = rts;
-    fprintf(stderr, " %3d%% %6d:%02d%c", int(100*ratio+0.5), rts / 60, rts % 60, pos+1 == max ? '\n' : '\r');
-  }
-}
-
 class patch {
 public:
   unsigned char data[(PATCH_SX+1)*PATCH_SY];
@@ -2332,7 +2307,7 @@ void net::draw(patch &p, int ox, int oy) const
     }
 }
 
-void draw(const char *format, const std::vector<node *> &nodes, const std::vector<net *> &nets)
+void draw(time_info &tinfo, const char *format, const std::vector<node *> &nodes, const std::vector<net *> &nets)
 {
   unsigned int plimx = int(state->info.sx / ratio)*10;
   unsigned int plimy = int(state->info.sy / ratio)*10;
@@ -2352,8 +2327,7 @@ void draw(const char *format, const std::vector<node *> &nodes, const std::vecto
 
   char msg[4096];
   sprintf(msg, "generating images, %d levels", limp);
-  time_info tinfo;
-  start(tinfo, msg);
+  tinfo.start(msg);
 
   unsigned int plim = 1 << (2*limp-2);
   patch *levels = new patch[limp];
@@ -2424,8 +2398,9 @@ void draw(const char *format, const std::vector<node *> &nodes, const std::vecto
       lx = lx >> 1;
       ly = ly >> 1;
     }
-    tick(tinfo, id++, (limx+1)*(limy+1));
+    tinfo.tick(id++, (limx+1)*(limy+1));
   }
+  tinfo.count(id);
   delete[] levels;
 }
 
@@ -2558,10 +2533,10 @@ void build_pads(const char *fname, std::vector<node *> &nodes, std::map<int, std
 
 void build_nets(std::vector<net *> &nets, const std::map<int, std::vector<ref> > &nodemap)
 {
-  for(unsigned int i=0; i != state->info.nets.size(); i++) {
+  for(int i=0; i != state->info.nnets; i++) {
     net *n = new net(i, nets.size(), false);
     nets.push_back(n);
-    if(int(i) == state->vcc || int(i) == state->gnd)
+    if(i == state->vcc || i == state->gnd)
       continue;
     std::map<int, std::vector<ref> >::const_iterator k = nodemap.find(i);
     if(k != nodemap.end())
@@ -3510,6 +3485,12 @@ int l_tiles(lua_State *L)
   return 0;
 }
 
+int l_profile(lua_State *L)
+{
+  opt_profile = lua_tostring(L, 1);
+  return 0;
+}
+
 int luaopen_mschem(lua_State *L)
 {
   static const luaL_Reg mschem_l[] = {
@@ -3525,6 +3506,7 @@ int luaopen_mschem(lua_State *L)
     { "svg",         l_svg         },
     { "geojson",     l_geojson     },
     { "tiles",       l_tiles       },
+    { "profile",     l_profile     },
 
     { }
   };
@@ -3577,13 +3559,19 @@ int main(int argc, char **argv)
   ratio = 1;
   opt_text = opt_svg = opt_geojson, opt_tiles = NULL;
 
+  time_info tinfo;
+  tinfo.stage("lua script");
   freetype_init();
 
   lua_fun(argv[1], nodes, nets);
+  tinfo.count(nodes.size());
 
+  tinfo.stage("net links");
   build_net_links(nets);
+  tinfo.count(nets.size());
 
   if(opt_svg) {
+    tinfo.stage("svg");
     FILE *fd = svg_open(opt_svg, state->info.sx / ratio * 10, state->info.sy / ratio * 10);
     for(unsigned int i=0; i != nodes.size(); i++)
       nodes[i]->to_svg(fd);
@@ -3594,6 +3582,7 @@ int main(int argc, char **argv)
   }
 
   if(opt_geojson) {
+    tinfo.stage("geojson");
     FILE *fd = geojson_open(opt_geojson, state->info.sx / ratio * 10, state->info.sy / ratio * 10);
     bool prev = false;
     for(unsigned int i=0; i != nodes.size(); i++)
@@ -3604,14 +3593,20 @@ int main(int argc, char **argv)
     geojson_close(fd);
   }
 
-  if(opt_text)
+  if(opt_text) {
+    tinfo.stage("text");
     save_txt(opt_text, state->info.sx / ratio, state->info.sy / ratio, nodes, nets);
+  }
 
   if(opt_tiles) {
     char buf[4096];
     sprintf(buf, "%s/%%d/%%d/%%d.png", opt_tiles);
-    draw(buf, nodes, nets);
+    draw(tinfo, buf, nodes, nets);
   }
 
+  tinfo.finish();
+  if(opt_profile && !tinfo.report(opt_profile, "mschem"))
+    exit(1);
+
   return 0;
 }
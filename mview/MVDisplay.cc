@@ -146,6 +146,16 @@ void MVDisplay::generate_image()
       if(metal_on && net_metal != -1 && state->display[net_metal])
 	col = 0x00ffff;
 
+      // Nets of an oscillation found by the last propagation
+      if(!in_cycle.empty()) {
+	if(active_on && net_active != -1 && in_cycle[net_active])
+	  col = 0xffff00;
+	if(poly_on && net_poly != -1 && in_cycle[net_poly])
+	  col = 0xffff00;
+	if(metal_on && net_metal != -1 && in_cycle[net_metal])
+	  col = 0xffff00;
+      }
+
       *dest++ = col | 0xff000000;
     }
 }
@@ -295,6 +305,12 @@ void MVDisplay::vscroll(int pos)
 
 void MVDisplay::state_changed()
 {
+  in_cycle.clear();
+  if(!state->cycle_nets.empty()) {
+    in_cycle.resize(state->info.nnets);
+    for(int net : state->cycle_nets)
+      in_cycle[net] = true;
+  }
   generate_image();
   update();
 }
@@ -44,6 +44,7 @@ private:
   double zoom;
   int xc, yc;
   bool active_on, poly_on, metal_on, levels_on;
+  std::vector<bool> in_cycle;
 
   void get(int l, int x, int y, int &circ, bool &inside, int &net, char &type, int &power);
   unsigned int alpha(unsigned int cur, unsigned int val, double level);
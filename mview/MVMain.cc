@@ -1,13 +1,17 @@
 #include "MVMain.h"
 #include "globals.h"
 
+#include <QFileDialog>
+
 #include <stdio.h>
 
 MVMain::MVMain(QWidget *parent) : QMainWindow(parent)
 {
   nlist = NULL;
+  cycle_status = false;
   setupUi(this);
   mvmain = this;
+  state->journaling = true;
   hscroll->setMaximum(state->info.sx);
   vscroll->setMaximum(state->info.sy);
 }
@@ -23,6 +27,7 @@ void MVMain::set_steps(int x1, int xp, int y1, int yp)
 void MVMain::set_status(const char *status)
 {
   statusbar->showMessage(status);
+  cycle_status = false;
 }
 
 void MVMain::track(int net)
@@ -40,8 +45,27 @@ void MVMain::track(int net)
   nlist->add_net(net);
 }
 
+void MVMain::checkpoint()
+{
+  if(!state->journal.empty()) {
+    undo_list.push_back(std::vector<State::change>());
+    undo_list.back().swap(state->journal);
+    redo_list.clear();
+  }
+}
+
 void MVMain::state_changed()
 {
+  checkpoint();
+  if(!state->cycle_nets.empty()) {
+    char msg[256];
+    sprintf(msg, "Oscillation over %d nets, left floating", int(state->cycle_nets.size()));
+    set_status(msg);
+    cycle_status = true;
+  } else if(cycle_status) {
+    statusbar->clearMessage();
+    cycle_status = false;
+  }
   state_change();
 }
 
@@ -59,11 +83,49 @@ void MVMain::net_list_closed()
 void MVMain::reset_to_floating()
 {
   state->reset_to_floating();
-  state_change();
+  state_changed();
 }
 
 void MVMain::reset_to_zero()
 {
   state->reset_to_zero();
+  state_changed();
+}
+
+// Reverting journals the reverse changes, which go to the other list
+void MVMain::undo()
+{
+  if(undo_list.empty())
+    return;
+  state->revert(undo_list.back());
+  undo_list.pop_back();
+  redo_list.push_back(std::vector<State::change>());
+  redo_list.back().swap(state->journal);
   state_change();
 }
+
+void MVMain::redo()
+{
+  if(redo_list.empty())
+    return;
+  state->revert(redo_list.back());
+  redo_list.pop_back();
+  undo_list.push_back(std::vector<State::change>());
+  undo_list.back().swap(state->journal);
+  state_change();
+}
+
+void MVMain::save_state()
+{
+  QString fname = QFileDialog::getSaveFileName(this, "Save state");
+  if(!fname.isEmpty())
+    state->save(fname.toLocal8Bit().constData());
+}
+
+void MVMain::load_state()
+{
+  QString fname = QFileDialog::getOpenFileName(this, "Load state");
+  if(!fname.isEmpty() && state->load(fname.toLocal8Bit().constData()))
+    state_changed();
+}
+
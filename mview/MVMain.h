@@ -4,6 +4,10 @@
 #include "ui_MVMainUI.h"
 #include "NetStateList.h"
 
+#include <State.h>
+
+#include <vector>
+
 class MVMain : public QMainWindow, private Ui::MVMainUI {
   Q_OBJECT
 
@@ -22,9 +26,21 @@ public slots:
   void net_list_closed();
   void reset_to_floating();
   void reset_to_zero();
+  void undo();
+  void redo();
+  void save_state();
+  void load_state();
 
 private:
   NetStateList *nlist;
+
+  // The status bar shows the oscillation of the last step
+  bool cycle_status;
+
+  // Journaled changes of each user action
+  std::vector<std::vector<State::change> > undo_list, redo_list;
+
+  void checkpoint();
 };
 
 #endif
@@ -8,10 +8,6 @@ NetState::NetState(int _net, QWidget *parent) : QWidget(parent)
   net = _net;
   setupUi(this);
   net_name->setText(state->ninfo.net_name(net).c_str());
-  int forced_power = state->forced_power[net];
-  r_0->setChecked(forced_power == State::S_0);
-  r_1->setChecked(forced_power == State::S_1);
-  r_float->setChecked(forced_power == State::S_FLOAT);
   state_changed();
 }
 
@@ -20,6 +16,18 @@ void NetState::state_changed()
   static const char *text[] = { "0", "1", "-" };
   int p = state->power[net];
   power->setText(text[p]);
+
+  // Follow undo/redo without forcing the net again
+  int forced_power = state->forced_power[net];
+  r_0->blockSignals(true);
+  r_1->blockSignals(true);
+  r_float->blockSignals(true);
+  r_0->setChecked(forced_power == State::S_0);
+  r_1->setChecked(forced_power == State::S_1);
+  r_float->setChecked(forced_power == State::S_FLOAT);
+  r_0->blockSignals(false);
+  r_1->blockSignals(false);
+  r_float->blockSignals(false);
 }
 
 void NetState::changed_r()
@@ -31,13 +39,8 @@ void NetState::changed_r()
     p = State::S_1;
   if(r_float->isChecked())
     p = State::S_FLOAT;
-  if(p != -1) {
-    state->forced_power[net] = p;
-    if(p != State::S_FLOAT)
-      state->power[net] = p;
-    std::set<int> changed;
-    changed.insert(net);
-    state->apply_changed(changed);
+  if(p != -1 && p != state->forced_power[net]) {
+    state->force(net, p);
     state_change();
   }
 }
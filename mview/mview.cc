@@ -37,8 +37,25 @@ int main(int argc, char **argv)
     fprintf(stderr, "Mode [%s] unknown\n", mode);
     exit(1);
   }    
+  rd.nl();
+  int threads = 0;
+  while(!rd.eof()) {
+    if(rd.peek() == '\n') {
+      rd.nl();
+      continue;
+    }
+    std::string keyw = rd.gw();
+    if(keyw == "threads") {
+      threads = rd.gi();
+      rd.nl();
+    } else {
+      fprintf(stderr, "Unknown keyword %s\n", keyw.c_str());
+      exit(1);
+    }
+  }
 
   state = new State(layers_file, map_file, pins_file, cmos);
+  state->threads = threads;
 
   QApplication app(argc, argv);
   MVMain mv;
@@ -954,13 +954,68 @@ void state_t::build()
       term_to_trans[m->netids[node::T1]].push_back(i);
       term_to_trans[m->netids[node::T2]].push_back(i);
    }
+
+  build_components();
+
+  group_of.assign(nn, -1);
+  nid_to_index.assign(nn, -1);
+  group_id = 0;
+}
+
+static int comp_find(std::vector<int> &parent, int nid)
+{
+  while(parent[nid] != nid) {
+    parent[nid] = parent[parent[nid]];
+    nid = parent[nid];
+  }
+  return nid;
+}
+
+void state_t::build_components()
+{
+  int nn = nets.size();
+  std::vector<int> parent(nn);
+  for(int i=0; i != nn; i++)
+    parent[i] = i;
+
+  for(unsigned int i=0; i != nodes.size(); i++)
+    if(nodes[i]->type == node::T || nodes[i]->type == node::D || nodes[i]->type == node::I) {
+      int r1 = comp_find(parent, nodes[i]->netids[node::T1]);
+      int r2 = comp_find(parent, nodes[i]->netids[node::T2]);
+      if(r1 < r2)
+	parent[r2] = r1;
+      else
+	parent[r1] = r2;
+    }
+
+  int nc = 0;
+  net_comp.resize(nn);
+  for(int i=0; i != nn; i++) {
+    int r = comp_find(parent, i);
+    net_comp[i] = r == i ? nc++ : net_comp[r];
+  }
+
+  comp_index.assign(nc+1, 0);
+  comp_trans.assign(nc, 0);
+  for(int i=0; i != nn; i++)
+    comp_index[net_comp[i]+1]++;
+  for(int i=0; i != nc; i++)
+    comp_index[i+1] += comp_index[i];
+  comp_nets.resize(nn);
+  std::vector<int> pos(comp_index.begin(), comp_index.end()-1);
+  for(int i=0; i != nn; i++)
+    comp_nets[pos[net_comp[i]]++] = i;
+
+  for(unsigned int i=0; i != nodes.size(); i++)
+    if(nodes[i]->type == node::T || nodes[i]->type == node::D || nodes[i]->type == node::I)
+      comp_trans[net_comp[nodes[i]->netids[node::T1]]]++;
 }
 
-void state_t::add_net(int nid, std::vector<int> &nids, std::set<int> &nid_set, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate)
+void state_t::add_net(int nid, std::vector<int> &nids, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate)
 {
-  if(nid_set.find(nid) == nid_set.end()) {
+  if(group_of[nid] != group_id) {
     nids.push_back(nid);
-    nid_set.insert(nid);
+    group_of[nid] = group_id;
     std::set<int>::iterator ci = changed.find(nid);
     if(ci != changed.end())
       changed.erase(ci);
@@ -969,19 +1024,19 @@ void state_t::add_net(int nid, std::vector<int> &nids, std::set<int> &nid_set, s
       std::vector<node *> n = j->second;
       rejected_trans_per_gate.erase(j);
       for(std::vector<node *>::const_iterator k = n.begin(); k != n.end(); k++)
-	add_transistor(*k, nids, nid_set, changed, accepted_trans, rejected_trans_per_gate);
+	add_transistor(*k, nids, changed, accepted_trans, rejected_trans_per_gate);
     }
   }
 }
 
-void state_t::add_transistor(node *tr, std::vector<int> &nids, std::set<int> &nid_set, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate)
+void state_t::add_transistor(node *tr, std::vector<int> &nids, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate)
 {
   accepted_trans.insert(tr);
-  add_net(tr->netids[node::T1], nids, nid_set, changed, accepted_trans, rejected_trans_per_gate);
-  add_net(tr->netids[node::T2], nids, nid_set, changed, accepted_trans, rejected_trans_per_gate);
+  add_net(tr->netids[node::T1], nids, changed, accepted_trans, rejected_trans_per_gate);
+  add_net(tr->netids[node::T2], nids, changed, accepted_trans, rejected_trans_per_gate);
 }
 
-void state_t::build_equation(std::string &equation, std::vector<int> &constants, const std::vector<int> &nids_to_solve, const std::vector<int> &levels, const std::set<node *> &accepted_trans, const std::map<int, int> &nid_to_index) const
+void state_t::build_equation(std::string &equation, std::vector<int> &constants, const std::vector<int> &nids_to_solve, const std::vector<int> &levels, const std::set<node *> &accepted_trans) const
 {
   constants.clear();
   equation = "";
@@ -991,14 +1046,9 @@ void state_t::build_equation(std::string &equation, std::vector<int> &constants,
     int ng  = tr->netids[node::GATE];
     int nt2 = tr->netids[node::T2];
 
-    std::map<int, int>::const_iterator k;
-
-    k = nid_to_index.find(nt1);
-    int t1_id   = k == nid_to_index.end() ? -1 : k->second;
-    k = nid_to_index.find(ng);
-    int gate_id = k == nid_to_index.end() ? -1 : k->second;
-    k = nid_to_index.find(nt2);
-    int t2_id   = k == nid_to_index.end() ? -1 : k->second;
+    int t1_id   = nid_to_index[nt1];
+    int gate_id = nid_to_index[ng];
+    int t2_id   = nid_to_index[nt2];
 
     int pnt1 = t1_id   == -1 ? power[nt1] : levels[t1_id];
     int png  = gate_id == -1 ? power[ng]  : levels[gate_id];
@@ -1076,14 +1126,19 @@ void state_t::apply_changed(std::set<int> changed)
 
     while(!changed.empty()) {
       bool verb = false;
+      int nid = *changed.begin();
+      changed.erase(changed.begin());
+
+      // Nothing to solve in a component without transistors
+      if(!comp_trans[net_comp[nid]])
+	continue;
+
       std::vector<int> nids;
-      std::set<int> nid_set;
       std::set<node *> accepted_trans;
       std::map<int, std::vector<node *> > rejected_trans_per_gate;
-      int nid = *changed.begin();
-      changed.erase(changed.begin());
+      group_id++;
       nids.push_back(nid);
-      nid_set.insert(nid);
+      group_of[nid] = group_id;
       for(int nididx=0; nididx != int(nids.size()); nididx++) {
 	int nid = nids[nididx];
 	for(std::vector<int>::const_iterator i = term_to_trans[nid].begin(); i != term_to_trans[nid].end(); i++) {
@@ -1092,8 +1147,8 @@ void state_t::apply_changed(std::set<int> changed)
 	  int nt2 = tr->netids[node::T2];
 	  int ng = tr->netids[node::GATE];
 	  int thr = power[ng] - (tr->type == node::T ? ET : ED);
-	  if(nid_set.find(ng) != nid_set.end() || thr-power[nt1] > 0 || thr-power[nt2] > 0)
-	    add_transistor(tr, nids, nid_set, changed, accepted_trans, rejected_trans_per_gate);
+	  if(group_of[ng] == group_id || thr-power[nt1] > 0 || thr-power[nt2] > 0)
+	    add_transistor(tr, nids, changed, accepted_trans, rejected_trans_per_gate);
 	  else
 	    rejected_trans_per_gate[ng].push_back(tr);
 	}
@@ -1117,7 +1172,6 @@ void state_t::apply_changed(std::set<int> changed)
 	  minmax(minv, maxv, power[ng]);
 	}
 
-	std::map<int, int> nid_to_index;
 	for(unsigned int i = 0; i != nids_to_solve.size(); i++)
 	  nid_to_index[nids_to_solve[i]] = i;
 
@@ -1128,7 +1182,9 @@ void state_t::apply_changed(std::set<int> changed)
 
 	std::string equation;
 	std::vector<int> constants;
-	build_equation(equation, constants, nids_to_solve, levels, accepted_trans, nid_to_index);
+	build_equation(equation, constants, nids_to_solve, levels, accepted_trans);
+	for(unsigned int i = 0; i != nids_to_solve.size(); i++)
+	  nid_to_index[nids_to_solve[i]] = -1;
 	if(equation == "Ta.. Daa. Taab")
 	  verb = true;
 	std::map<std::string, void (*)(const std::vector<int> &constants, std::vector<int> &level)>::const_iterator sp = solvers.find(equation);
@@ -77,6 +77,13 @@ public:
   std::vector<std::vector<int> > gate_to_trans;
   std::vector<std::vector<int> > term_to_trans;
 
+  // Channel-connected components, nets linked through transistor
+  // terminals.  Members of component c are
+  // comp_nets[comp_index[c]..comp_index[c+1]-1], comp_trans[c] is its
+  // number of transistors.
+  std::vector<int> net_comp;
+  std::vector<int> comp_index, comp_nets, comp_trans;
+
 
   std::set<std::string> save_selected;
   std::map<std::string, char> save_fixed_level;
@@ -101,11 +108,18 @@ private:
     ED = -30
   };
 
-  void add_transistor(node *tr, std::vector<int> &nids, std::set<int> &nid_set, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate);
-  void add_net(int nid, std::vector<int> &nids, std::set<int> &nid_set, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate);
+  // Per net scratch for apply_changed: group the net was last added
+  // to, and its index in the nets to solve (-1 when not solved)
+  std::vector<int> group_of;
+  std::vector<int> nid_to_index;
+  int group_id;
+
+  void build_components();
+  void add_transistor(node *tr, std::vector<int> &nids, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate);
+  void add_net(int nid, std::vector<int> &nids, std::set<int> &changed, std::set<node *> &accepted_trans, std::map<int, std::vector<node *> > &rejected_trans_per_gate);
   void dump_equation_system(std::string equation, const std::vector<int> &constants, const std::vector<int> &nids_to_solve, const std::set<node *> &accepted_trans);
   std::string c2s(int vr, const std::vector<int> &constants, int pos);
-  void build_equation(std::string &equation, std::vector<int> &constants, const std::vector<int> &nids_to_solve, const std::vector<int> &levels, const std::set<node *> &accepted_trans, const std::map<int, int> &nid_to_index) const;
+  void build_equation(std::string &equation, std::vector<int> &constants, const std::vector<int> &nids_to_solve, const std::vector<int> &levels, const std::set<node *> &accepted_trans) const;
 
   static void pull(int &term, int gate, int oterm);
   static void minmax(int &minv, int &maxv, int value);